@@ -25,8 +25,21 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
+#include <fcntl.h>
 #include <locale.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <linux/capability.h>
 #include <glib/gi18n.h>
+#include <gio/gunixmounts.h>
 
 #ifdef LXPLUG
 #include "plugin.h"
@@ -42,12 +55,38 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define DEBUG_ON
 #ifdef DEBUG_ON
-#define DEBUG(fmt,args...) if(getenv("DEBUG_EJ"))g_message("ej: " fmt,##args)
+#define DEBUG(fmt,args...) trace_log(fmt,##args)
+#define DEBUG_DRIVE(evt,drv) trace_drive(evt,drv)
+#define DEBUG_VOLUME(evt,vol) trace_volume(evt,vol)
+#define DEBUG_MOUNT(evt,mnt) trace_mount(evt,mnt)
 #else
 #define DEBUG(fmt,args...)
+#define DEBUG_DRIVE(evt,drv)
+#define DEBUG_VOLUME(evt,vol)
+#define DEBUG_MOUNT(evt,mnt)
 #endif
 
-#define HIDE_TIME_MS 5000
+/* Trace ring buffer - a power of 2 entries, so the head index can wrap freely */
+#define TRACE_ENTRIES 2048
+#define TRACE_LEN 128
+
+#define POLL_DEFAULT_MS "/sys/module/block/parameters/events_dfl_poll_msecs"
+
+/* Filter rules are separated by semicolons, and each is a glob prefixed with what it matches:
+ * dev: device path, fs: filesystem type, bus: sysfs path of the block device, mnt: start of mount point */
+#define DEFAULT_FILTER "dev:/dev/loop*;fs:squashfs;fs:nfs*;fs:cifs;fs:smb*;fs:fuse.sshfs;mnt:/snap/"
+
+/* Values in the filter cache - anything not in it has not been checked yet */
+#define FILTER_DROP GINT_TO_POINTER (1)
+#define FILTER_KEEP GINT_TO_POINTER (2)
+
+/* Slowest write speed expected from a removable drive, used to turn an eject time into a dirty data limit */
+#define DIRTY_WRITE_BPS (4 * 1024 * 1024)
+
+#define UDISKS_NAME "org.freedesktop.UDisks2"
+#define UDISKS_MANAGER_PATH "/org/freedesktop/UDisks2/Manager"
+#define UDISKS_MANAGER_IFACE "org.freedesktop.UDisks2.Manager"
+#define UDISKS_FS_IFACE "org.freedesktop.UDisks2.Filesystem"
 
 typedef struct {
     EjecterPlugin *ej;
@@ -59,239 +98,1817 @@ typedef struct {
     int seq;
 } EjectList;
 
+typedef struct {
+    GDrive *drv;
+    char *dev;                      /* Block device name, e.g. "sdb" */
+    gint64 empty_since;             /* Time media was removed, 0 if present */
+    gint64 suspended;               /* Time polling was suspended, 0 if active */
+    int poll_ms;                    /* Kernel poll interval while active */
+    char *orig_ms;                  /* Value of events_poll_msecs to restore */
+    gboolean blocked;               /* Kernel polling cannot be changed */
+} PollList;
+
+typedef struct {
+    GDrive *drv;
+    char *dev;                      /* Block device name, e.g. "sdb" */
+    char *bdi;                      /* sysfs directory of the drive's BDI */
+    char *orig_ratio;               /* Settings to put back when the limit is removed */
+    char *orig_strict;
+    guint64 bytes;                  /* Dirty data allowed */
+    const char *method;             /* How the limit was applied, NULL if it could not be */
+} DirtyLimit;
+
+typedef struct {
+    char *path;                     /* Mount point */
+    char *dev;                      /* Device path, e.g. "/dev/sdb1" */
+} SafeVolume;
+
+typedef struct {
+    EjecterPlugin *ej;
+    GDrive *drv;
+    GList *vols;                    /* SafeVolume for each mounted volume */
+    char *error;                    /* First failure, if any */
+} SafeData;
+
+typedef struct {
+    EjecterPlugin *ej;
+    char *dev;                      /* Block device name of the removed drive */
+    char *name;                     /* Display name of the removed drive */
+    int mounts;                     /* Stale mounts detached */
+    int failed;                     /* Stale mounts which could not be detached */
+    GString *procs;                 /* Processes which were using the stale mounts */
+} StaleData;
+
 /*----------------------------------------------------------------------------*/
 /* Global data                                                                */
 /*----------------------------------------------------------------------------*/
 
+#ifdef DEBUG_ON
+/* Trace is shared by all instances in the process; each entry is preformatted
+ * so that it can be dumped from a signal handler using write() alone */
+static char trace_buf[TRACE_ENTRIES][TRACE_LEN];
+static gint trace_head;
+static gboolean trace_echo;
+static int trace_users;
+static struct sigaction trace_old_segv, trace_old_abrt, trace_old_bus;
+#endif
+
 /*----------------------------------------------------------------------------*/
 /* Prototypes                                                                 */
 /*----------------------------------------------------------------------------*/
 
+#ifdef DEBUG_ON
+static void trace_log (const char *fmt, ...) G_GNUC_PRINTF (1, 2);
+static void trace_drive (const char *evt, GDrive *drive);
+static void trace_volume (const char *evt, GVolume *vol);
+static void trace_mount (const char *evt, GMount *mount);
+static void trace_dump (int fd);
+static void trace_crash (int sig);
+static void trace_start (void);
+static void trace_stop (void);
+#endif
+static void journal_open (EjecterPlugin *ej);
+static void journal_close (EjecterPlugin *ej);
+static void journal_sync (EjecterPlugin *ej);
+static JournalRecord *journal_find (EjecterPlugin *ej, GDrive *drive, gboolean create);
+static void journal_set_flag (EjecterPlugin *ej, GDrive *drive, guint32 flag, gboolean set);
+static void journal_log_eject_time (EjecterPlugin *ej, GDrive *drive, int limited, guint ms);
+static void journal_set_limit (EjecterPlugin *ej, GDrive *drive, DirtyLimit *dl);
+static void journal_restore (EjecterPlugin *ej);
 static void log_eject (EjecterPlugin *ej, GDrive *drive);
 static gboolean was_ejected (EjecterPlugin *ej, GDrive *drive);
+static gboolean is_ejected (EjecterPlugin *ej, GDrive *drive);
 static void log_mount (EjecterPlugin *ej, GMount *mount);
 static void log_init_mounts (EjecterPlugin *ej);
 static gboolean was_mounted (EjecterPlugin *ej, GDrive *drive);
 static void add_seq_for_drive (EjecterPlugin *ej, GDrive *drive, int seq);
+static void free_filter (EjecterPlugin *ej);
+static void compile_filter (EjecterPlugin *ej);
+static gboolean match_any (GPtrArray *pats, const char *str);
+static gboolean drive_filtered (EjecterPlugin *ej, GDrive *drive);
+static gboolean mount_filtered (EjecterPlugin *ej, GMount *mount);
+static gboolean volume_filtered (EjecterPlugin *ej, GVolume *vol);
 static void handle_mount_in (GtkWidget *, GMount *mount, gpointer data);
 static void handle_mount_out (GtkWidget *, GMount *mount, gpointer data);
+static void handle_mount_changed (GtkWidget *, GMount *mount, gpointer data);
 static void handle_mount_pre (GtkWidget *, GMount *mount, gpointer data);
 static void handle_volume_in (GtkWidget *, GVolume *vol, gpointer data);
 static void handle_volume_out (GtkWidget *, GVolume *vol, gpointer data);
 static void handle_drive_in (GtkWidget *, GDrive *drive, gpointer data);
 static void handle_drive_out (GtkWidget *, GDrive *drive, gpointer data);
+static void handle_drive_changed (GtkWidget *, GDrive *drive, gpointer data);
+static int sysfs_read_int (const char *path, int def);
+static gboolean sysfs_write (const char *path, const char *val);
+static char *drive_dev_name (GDrive *drive);
+static PollList *find_poll_drive (EjecterPlugin *ej, GDrive *drive);
+static void track_poll_drive (EjecterPlugin *ej, GDrive *drive);
+static void untrack_poll_drive (EjecterPlugin *ej, GDrive *drive);
+static void suspend_polling (PollList *pl);
+static void resume_polling (EjecterPlugin *ej, PollList *pl);
+static void update_polling (EjecterPlugin *ej);
+static gboolean poll_idle_timeout (gpointer data);
+static void poll_media (EjecterPlugin *ej);
+static void poll_done (GObject *source_object, GAsyncResult *res, gpointer);
+static void stop_polling (EjecterPlugin *ej);
+static void show_stats (EjecterPlugin *ej);
+static DirtyLimit *find_dirty_limit (EjecterPlugin *ej, const char *dev);
+static char *bdi_dir (const char *dev);
+static void limit_dirty (EjecterPlugin *ej, GDrive *drive);
+static void apply_dirty_limit (EjecterPlugin *ej, DirtyLimit *dl);
+static void restore_dirty_limit (EjecterPlugin *ej, DirtyLimit *dl);
+static void restore_stale_limit (EjecterPlugin *ej, GDrive *drive, JournalRecord *jr);
+static void free_dirty_limit (EjecterPlugin *ej, DirtyLimit *dl);
+static void update_dirty_limits (EjecterPlugin *ej);
+static void unlimit_dirty (EjecterPlugin *ej, GDrive *drive);
+static guint64 dirty_threshold (void);
 static void handle_eject_clicked (GtkWidget *widget, gpointer ptr);
 static void eject_done (GObject *source_object, GAsyncResult *res, gpointer ptr);
-static gboolean is_drive_mounted (GDrive *d);
+static void handle_safe_clicked (GtkWidget *widget, gpointer ptr);
+static void make_safe (EjecterPlugin *ej, GDrive *drv);
+static char *udisks_object (GDBusConnection *bus, const char *dev, GError **err);
+static gboolean udisks_call (GDBusConnection *bus, const char *dev, const char *method, GVariant *params, char **path, GError **err);
+static void make_safe_thread (GTask *task, gpointer, gpointer data, GCancellable *);
+static void make_safe_done (GObject *, GAsyncResult *res, gpointer);
+static void free_safe_data (SafeData *sd);
+static gboolean is_mount_writable (GMount *m);
+static gboolean is_drive_writable (GDrive *d);
+static void clean_stale (EjecterPlugin *ej, GDrive *drive);
+static gboolean is_part_of (const char *path, const char *dev);
+static gboolean is_under (const char *path, GList *mnts);
+static void find_stale_users (GList *mnts, GString *procs);
+static void clean_stale_thread (GTask *task, gpointer, gpointer data, GCancellable *);
+static void clean_stale_done (GObject *, GAsyncResult *res, gpointer);
+static void free_stale_data (StaleData *sd);
+static gboolean is_drive_mounted (EjecterPlugin *ej, GDrive *d);
 static void update_icon (EjecterPlugin *ej);
 static void show_menu (EjecterPlugin *ej);
 static void hide_menu (EjecterPlugin *ej);
 static GtkWidget *create_menuitem (EjecterPlugin *ej, GDrive *d);
 static void ejecter_button_clicked (GtkWidget *, EjecterPlugin * ej);
 
-/*----------------------------------------------------------------------------*/
-/* Function definitions                                                       */
-/*----------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------------*/
+/* Function definitions                                                       */
+/*----------------------------------------------------------------------------*/
+
+#ifdef DEBUG_ON
+
+/* Trace functions */
+
+static void trace_log (const char *fmt, ...)
+{
+    gint64 now = g_get_monotonic_time ();
+    guint slot = (guint) g_atomic_int_add (&trace_head, 1) % TRACE_ENTRIES;
+    char *buf = trace_buf[slot];
+    va_list args;
+    int len;
+
+    len = snprintf (buf, TRACE_LEN, "[%6" G_GINT64_FORMAT ".%03d] ", now / G_USEC_PER_SEC, (int) ((now / 1000) % 1000));
+    va_start (args, fmt);
+    vsnprintf (buf + len, TRACE_LEN - len, fmt, args);
+    va_end (args);
+
+    if (trace_echo) g_message ("ej: %s", buf + len);
+}
+
+static void trace_drive (const char *evt, GDrive *drive)
+{
+    char *name = drive ? g_drive_get_name (drive) : NULL;
+    trace_log ("%s %s", evt, name ? name : "(none)");
+    g_free (name);
+}
+
+static void trace_volume (const char *evt, GVolume *vol)
+{
+    char *name = g_volume_get_name (vol);
+    trace_log ("%s %s", evt, name ? name : "(none)");
+    g_free (name);
+}
+
+static void trace_mount (const char *evt, GMount *mount)
+{
+    char *name = g_mount_get_name (mount);
+    trace_log ("%s %s", evt, name ? name : "(none)");
+    g_free (name);
+}
+
+/* Write out the buffer, oldest entry first - must stay async-signal-safe */
+static void trace_dump (int fd)
+{
+    guint head = (guint) g_atomic_int_get (&trace_head);
+    guint slot = head >= TRACE_ENTRIES ? head - TRACE_ENTRIES : 0;
+
+    for (; slot != head; slot++)
+    {
+        const char *line = trace_buf[slot % TRACE_ENTRIES];
+        if (!line[0]) continue;
+        if (write (fd, line, strnlen (line, TRACE_LEN)) < 0) return;
+        if (write (fd, "\n", 1) < 0) return;
+    }
+}
+
+static void trace_crash (int sig)
+{
+    static const char msg[] = "ej: crashed - dumping trace\n";
+    struct sigaction *old;
+
+    if (write (STDERR_FILENO, msg, sizeof (msg) - 1) >= 0) trace_dump (STDERR_FILENO);
+
+    /* Put back whatever handler was there before and let it run */
+    if (sig == SIGSEGV) old = &trace_old_segv;
+    else if (sig == SIGBUS) old = &trace_old_bus;
+    else old = &trace_old_abrt;
+    sigaction (sig, old, NULL);
+    raise (sig);
+}
+
+static void trace_start (void)
+{
+    struct sigaction sa;
+
+    if (trace_users++) return;
+
+    trace_echo = getenv ("DEBUG_EJ") != NULL;
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = trace_crash;
+    sigemptyset (&sa.sa_mask);
+    sa.sa_flags = SA_RESETHAND;
+    sigaction (SIGSEGV, &sa, &trace_old_segv);
+    sigaction (SIGBUS, &sa, &trace_old_bus);
+    sigaction (SIGABRT, &sa, &trace_old_abrt);
+}
+
+static void trace_stop (void)
+{
+    if (--trace_users) return;
+
+    /* The handler lives in this module, so it must not outlast it */
+    sigaction (SIGSEGV, &trace_old_segv, NULL);
+    sigaction (SIGBUS, &trace_old_bus, NULL);
+    sigaction (SIGABRT, &trace_old_abrt, NULL);
+}
+
+#endif
+
+/* Journal functions */
+
+/* Map the journal - there is nothing to read in, so this costs the same however much it holds */
+static void journal_open (EjecterPlugin *ej)
+{
+    Journal *jnl = MAP_FAILED;
+    struct stat st;
+    char *path;
+    int fd, i;
+
+    path = g_build_filename (g_get_user_runtime_dir (), "ejecter.journal", NULL);
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd >= 0 && fstat (fd, &st) == 0 && (st.st_size == sizeof (Journal) || ftruncate (fd, sizeof (Journal)) == 0))
+        jnl = mmap (NULL, sizeof (Journal), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0) close (fd);
+    g_free (path);
+
+    /* Without a file, keep the journal in memory so that nothing else needs to care */
+    ej->jmapped = jnl != MAP_FAILED;
+    if (!ej->jmapped)
+    {
+        DEBUG ("JOURNAL NOT AVAILABLE");
+        jnl = g_new0 (Journal, 1);
+    }
+
+    if (jnl->magic != JOURNAL_MAGIC || jnl->version != JOURNAL_VERSION)
+    {
+        memset (jnl, 0, sizeof (Journal));
+        jnl->magic = JOURNAL_MAGIC;
+        jnl->version = JOURNAL_VERSION;
+    }
+
+    /* Anything caught part way through an update by a crash is discarded */
+    if (jnl->seq & 1)
+    {
+        memset (jnl->ejects, 0, sizeof (jnl->ejects));
+        memset (jnl->eject_max_ms, 0, sizeof (jnl->eject_max_ms));
+        memset (jnl->eject_ms, 0, sizeof (jnl->eject_ms));
+        jnl->seq = 0;
+    }
+    for (i = 0; i < JOURNAL_SLOTS; i++)
+        if (jnl->rec[i].seq & 1) memset (&jnl->rec[i], 0, sizeof (JournalRecord));
+
+    ej->journal = jnl;
+}
+
+static void journal_close (EjecterPlugin *ej)
+{
+    if (ej->jmapped) munmap (ej->journal, sizeof (Journal));
+    else g_free (ej->journal);
+    ej->journal = NULL;
+}
+
+static void journal_sync (EjecterPlugin *ej)
+{
+    if (ej->jmapped) msync (ej->journal, sizeof (Journal), MS_ASYNC);
+}
+
+/* Find the record for a drive, if asked taking over a free slot or else the one least recently used */
+static JournalRecord *journal_find (EjecterPlugin *ej, GDrive *drive, gboolean create)
+{
+    JournalRecord *jr = NULL, *old = NULL;
+    char *dev, *name;
+    int i;
+
+    if (!drive || !(dev = drive_dev_name (drive))) return NULL;
+    name = g_drive_get_name (drive);
+
+    for (i = 0; i < JOURNAL_SLOTS && !jr; i++)
+    {
+        JournalRecord *r = &ej->journal->rec[i];
+        if (!strncmp (r->dev, dev, sizeof (r->dev)) && !strncmp (r->name, name ? name : "", sizeof (r->name))) jr = r;
+        else if (!old || !r->dev[0] || (old->dev[0] && r->updated < old->updated)) old = r;
+    }
+
+    if (!jr && create)
+    {
+        jr = old;
+        g_atomic_int_inc (&jr->seq);
+        memset ((char *) jr + sizeof (jr->seq), 0, sizeof (JournalRecord) - sizeof (jr->seq));
+        g_strlcpy (jr->dev, dev, sizeof (jr->dev));
+        g_strlcpy (jr->name, name ? name : "", sizeof (jr->name));
+        jr->updated = g_get_real_time ();
+        g_atomic_int_inc (&jr->seq);
+    }
+
+    g_free (name);
+    g_free (dev);
+    return jr;
+}
+
+static void journal_set_flag (EjecterPlugin *ej, GDrive *drive, guint32 flag, gboolean set)
+{
+    JournalRecord *jr = journal_find (ej, drive, set);
+
+    if (!jr || !(jr->flags & flag) == !set) return;
+
+    g_atomic_int_inc (&jr->seq);
+    if (set) jr->flags |= flag;
+    else jr->flags &= ~flag;
+    jr->updated = g_get_real_time ();
+    g_atomic_int_inc (&jr->seq);
+    journal_sync (ej);
+}
+
+static void journal_log_eject_time (EjecterPlugin *ej, GDrive *drive, int limited, guint ms)
+{
+    Journal *jnl = ej->journal;
+    JournalRecord *jr;
+
+    g_atomic_int_inc (&jnl->seq);
+    jnl->ejects[limited]++;
+    jnl->eject_ms[limited] += ms;
+    if (ms > jnl->eject_max_ms[limited]) jnl->eject_max_ms[limited] = ms;
+    g_atomic_int_inc (&jnl->seq);
+
+    if ((jr = journal_find (ej, drive, TRUE)))
+    {
+        g_atomic_int_inc (&jr->seq);
+        jr->ejects++;
+        jr->eject_ms += ms;
+        if (ms > jr->eject_max_ms) jr->eject_max_ms = ms;
+        jr->updated = g_get_real_time ();
+        g_atomic_int_inc (&jr->seq);
+    }
+    journal_sync (ej);
+}
+
+/* Keep what a dirty data limit replaced, so that it can be put back even after a crash - NULL once it has been */
+static void journal_set_limit (EjecterPlugin *ej, GDrive *drive, DirtyLimit *dl)
+{
+    JournalRecord *jr = journal_find (ej, drive, dl != NULL);
+
+    if (!jr || (!dl && !(jr->flags & JOURNAL_LIMITED))) return;
+
+    g_atomic_int_inc (&jr->seq);
+    if (dl)
+    {
+        jr->flags |= JOURNAL_LIMITED;
+        jr->orig_ratio = dl->orig_ratio ? atoi (dl->orig_ratio) : -1;
+        jr->orig_strict = dl->orig_strict ? atoi (dl->orig_strict) : -1;
+    }
+    else jr->flags &= ~JOURNAL_LIMITED;
+    jr->updated = g_get_real_time ();
+    g_atomic_int_inc (&jr->seq);
+    journal_sync (ej);
+}
+
+/* Put back the ejected state of drives still connected since the last run - the mounted state is
+ * rebuilt from the live mounts, as drives may have been unmounted while no-one was watching, and
+ * a drive which has been mounted read-write again since is no longer safe to remove. Dirty data
+ * limits left behind are taken over if still wanted, otherwise removed. */
+static void journal_restore (EjecterPlugin *ej)
+{
+    GList *iter, *drives = g_volume_monitor_get_connected_drives (ej->monitor);
+    gboolean seen[JOURNAL_SLOTS] = { FALSE };
+    int i;
+
+    for (iter = drives; iter != NULL; iter = g_list_next (iter))
+    {
+        GDrive *drv = (GDrive *) iter->data;
+        JournalRecord *jr;
+
+        if (drive_filtered (ej, drv) || !(jr = journal_find (ej, drv, FALSE))) continue;
+        seen[jr - ej->journal->rec] = TRUE;
+        if ((jr->flags & JOURNAL_MOUNTED) && !g_list_find (ej->mdrives, drv))
+            journal_set_flag (ej, drv, JOURNAL_MOUNTED, FALSE);
+        if ((jr->flags & JOURNAL_EJECTED) && is_drive_writable (drv))
+            journal_set_flag (ej, drv, JOURNAL_EJECTED, FALSE);
+        else if (jr->flags & JOURNAL_EJECTED)
+        {
+            DEBUG_DRIVE ("RESTORED EJECTED", drv);
+            log_eject (ej, drv);
+        }
+        if (jr->flags & JOURNAL_LIMITED) restore_stale_limit (ej, drv, jr);
+    }
+    g_list_free_full (drives, g_object_unref);
+
+    /* State of drives which have gone no longer applies, but their history is kept */
+    for (i = 0; i < JOURNAL_SLOTS; i++)
+    {
+        JournalRecord *jr = &ej->journal->rec[i];
+        if (seen[i] || !jr->flags) continue;
+
+        g_atomic_int_inc (&jr->seq);
+        jr->flags = 0;
+        g_atomic_int_inc (&jr->seq);
+    }
+    journal_sync (ej);
+}
+
+
+/* Drive logging functions */
+
+static void log_eject (EjecterPlugin *ej, GDrive *drive)
+{
+    EjectList *el;
+    el = g_new (EjectList, 1);
+    el->drv = drive;
+    el->seq = -1;
+    ej->ejdrives = g_list_append (ej->ejdrives, el);
+    journal_set_flag (ej, drive, JOURNAL_EJECTED, TRUE);
+}
+
+static gboolean was_ejected (EjecterPlugin *ej, GDrive *drive)
+{
+    GList *l, *next;
+    gboolean ejected = FALSE;
+    for (l = ej->ejdrives; l != NULL; l = next)
+    {
+        EjectList *el = (EjectList *) l->data;
+        next = l->next;
+        if (el->drv == drive)
+        {
+            ejected = TRUE;
+            if (el->seq != -1) lxpanel_notify_clear (el->seq);
+            ej->ejdrives = g_list_delete_link (ej->ejdrives, l);
+            g_free (el);
+        }
+    }
+    journal_set_flag (ej, drive, JOURNAL_EJECTED, FALSE);
+    return ejected;
+}
+
+static gboolean is_ejected (EjecterPlugin *ej, GDrive *drive)
+{
+    GList *l;
+    for (l = ej->ejdrives; l != NULL; l = l->next)
+        if (((EjectList *) l->data)->drv == drive) return TRUE;
+    return FALSE;
+}
+
+static void log_mount (EjecterPlugin *ej, GMount *mount)
+{
+    GList *l;
+    GDrive *drv, *drive;
+
+    if (mount_filtered (ej, mount)) return;
+
+    drive = g_mount_get_drive (mount);
+    if (ej->ejecttime > 0 && g_drive_is_removable (drive)) limit_dirty (ej, drive);
+
+    /* A read-write mount means an earlier eject or make safe no longer holds */
+    if (is_mount_writable (mount)) was_ejected (ej, drive);
+
+    for (l = ej->mdrives; l != NULL; l = l->next)
+    {
+        drv = (GDrive *) l->data;
+        if (drv == drive)
+        {
+            g_object_unref (drive);
+            return;
+        }
+    }
+
+    ej->mdrives = g_list_append (ej->mdrives, drive);
+    journal_set_flag (ej, drive, JOURNAL_MOUNTED, TRUE);
+    DEBUG_DRIVE ("MOUNTED DRIVE", drive);
+}
+
+static void log_init_mounts (EjecterPlugin *ej)
+{
+    ej->mdrives = NULL;
+    GList *l, *mnts = g_volume_monitor_get_mounts (ej->monitor);
+    for (l = mnts; l != NULL; l = l->next)
+    {
+        log_mount (ej, (GMount *) l->data);
+        g_object_unref (l->data);
+    }
+    g_list_free (mnts);
+}
+
+static gboolean was_mounted (EjecterPlugin *ej, GDrive *drive)
+{
+    GList *l;
+    GDrive *drv;
+
+    journal_set_flag (ej, drive, JOURNAL_MOUNTED, FALSE);
+    for (l = ej->mdrives; l != NULL; l = l->next)
+    {
+        drv = (GDrive *) l->data;
+        if (drv == drive)
+        {
+            ej->mdrives = g_list_remove (ej->mdrives, drv);
+            g_object_unref (drv);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void add_seq_for_drive (EjecterPlugin *ej, GDrive *drive, int seq)
+{
+    GList *l;
+    for (l = ej->ejdrives; l != NULL; l = l->next)
+    {
+        EjectList *el = (EjectList *) l->data;
+        if (el->drv == drive)
+        {
+            el->seq = seq;
+            return;
+        }
+    }
+}
+
+/* Filter functions */
+
+static void free_filter (EjecterPlugin *ej)
+{
+    if (ej->fdev) g_ptr_array_free (ej->fdev, TRUE);
+    if (ej->ffs) g_ptr_array_free (ej->ffs, TRUE);
+    if (ej->fbus) g_ptr_array_free (ej->fbus, TRUE);
+    if (ej->fmnt) g_ptr_array_free (ej->fmnt, TRUE);
+    ej->fdev = ej->ffs = ej->fbus = ej->fmnt = NULL;
+    g_free (ej->fcompiled);
+    ej->fcompiled = NULL;
+}
+
+/* Build the matcher from the rule string; cached results are dropped as they may no longer hold */
+static void compile_filter (EjecterPlugin *ej)
+{
+    char **rules, **rule, *pat;
+    GPtrArray *arr;
+
+    free_filter (ej);
+    ej->fdev = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+    ej->ffs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+    ej->fbus = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+    ej->fmnt = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+
+    rules = g_strsplit (ej->filter ? ej->filter : "", ";", -1);
+    for (rule = rules; *rule; rule++)
+    {
+        pat = g_strstrip (*rule);
+        if (g_str_has_prefix (pat, "dev:")) arr = ej->fdev;
+        else if (g_str_has_prefix (pat, "fs:")) arr = ej->ffs;
+        else if (g_str_has_prefix (pat, "bus:")) arr = ej->fbus;
+        else if (g_str_has_prefix (pat, "mnt:")) arr = ej->fmnt;
+        else
+        {
+            if (*pat) DEBUG ("BAD FILTER RULE %s", pat);
+            continue;
+        }
+
+        pat = strchr (pat, ':') + 1;
+        if (!*pat) continue;
+        if (arr == ej->fmnt)
+        {
+            pat = g_strconcat (pat, "*", NULL);
+            g_ptr_array_add (arr, g_pattern_spec_new (pat));
+            g_free (pat);
+        }
+        else g_ptr_array_add (arr, g_pattern_spec_new (pat));
+    }
+    g_strfreev (rules);
+    ej->fcompiled = g_strdup (ej->filter);
+
+    g_hash_table_remove_all (ej->fcache);
+    DEBUG ("FILTER %u dev, %u fs, %u bus, %u mnt", ej->fdev->len, ej->ffs->len, ej->fbus->len, ej->fmnt->len);
+}
+
+static gboolean match_any (GPtrArray *pats, const char *str)
+{
+    guint i;
+
+    if (!str) return FALSE;
+    for (i = 0; i < pats->len; i++)
+        if (g_pattern_spec_match_string ((GPatternSpec *) pats->pdata[i], str)) return TRUE;
+    return FALSE;
+}
+
+static gboolean drive_filtered (EjecterPlugin *ej, GDrive *drive)
+{
+    gpointer res = g_hash_table_lookup (ej->fcache, drive);
+    char *dev, *name, *sys, *real;
+
+    if (res) return res == FILTER_DROP;
+
+    dev = g_drive_get_identifier (drive, "unix-device");
+    res = match_any (ej->fdev, dev) ? FILTER_DROP : FILTER_KEEP;
+    if (res == FILTER_KEEP && dev && ej->fbus->len)
+    {
+        /* The resolved sysfs link gives the path through the buses, e.g. ".../usb1/1-1/..." */
+        name = g_path_get_basename (dev);
+        sys = g_strconcat ("/sys/class/block/", name, NULL);
+        real = realpath (sys, NULL);
+        if (match_any (ej->fbus, real)) res = FILTER_DROP;
+        free (real);
+        g_free (sys);
+        g_free (name);
+    }
+    g_free (dev);
+
+    g_hash_table_insert (ej->fcache, g_object_ref (drive), res);
+    if (res == FILTER_DROP) DEBUG_DRIVE ("FILTERED DRIVE", drive);
+    return res == FILTER_DROP;
+}
+
+static gboolean mount_filtered (EjecterPlugin *ej, GMount *mount)
+{
+    gpointer res = g_hash_table_lookup (ej->fcache, mount);
+    GUnixMountEntry *me;
+    GDrive *drv;
+    GFile *root;
+    char *path;
+
+    if (res) return res == FILTER_DROP;
+
+    /* Mounts without a drive never appear in the menu, so there is no point looking at them - but the
+     * drive may not have been attached yet, so don't remember that */
+    if (!(drv = g_mount_get_drive (mount))) return TRUE;
+    res = drive_filtered (ej, drv) ? FILTER_DROP : FILTER_KEEP;
+    g_object_unref (drv);
+
+    if (res == FILTER_KEEP && (ej->fmnt->len || ej->ffs->len || ej->fdev->len))
+    {
+        root = g_mount_get_root (mount);
+        path = g_file_get_path (root);
+        if (match_any (ej->fmnt, path)) res = FILTER_DROP;
+        else if (path && (me = g_unix_mount_at (path, NULL)))
+        {
+            if (match_any (ej->ffs, g_unix_mount_get_fs_type (me))
+                || match_any (ej->fdev, g_unix_mount_get_device_path (me))) res = FILTER_DROP;
+            g_unix_mount_free (me);
+        }
+        g_free (path);
+        g_object_unref (root);
+    }
+
+    g_hash_table_insert (ej->fcache, g_object_ref (mount), res);
+    return res == FILTER_DROP;
+}
+
+static gboolean volume_filtered (EjecterPlugin *ej, GVolume *vol)
+{
+    GDrive *drv = g_volume_get_drive (vol);
+    gboolean res = TRUE;
+
+    if (drv)
+    {
+        res = drive_filtered (ej, drv);
+        g_object_unref (drv);
+    }
+    return res;
+}
+
+/* Volume monitor handlers */
+
+static void handle_mount_in (GtkWidget *, GMount *mount, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    if (mount_filtered (ej, mount)) return;
+    DEBUG_MOUNT ("MOUNT ADDED", mount);
+
+    log_mount (ej, mount);
+    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
+    update_icon (ej);
+}
+
+static void handle_mount_out (GtkWidget *, GMount *mount, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    gboolean filtered = mount_filtered (ej, mount);
+
+    g_hash_table_remove (ej->fcache, mount);
+    if (filtered) return;
+    DEBUG_MOUNT ("MOUNT REMOVED", mount);
+
+    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
+    update_icon (ej);
+}
+
+/* Catches mounts whose drive was not yet attached when they were added */
+static void handle_mount_changed (GtkWidget *, GMount *mount, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    if (mount_filtered (ej, mount)) return;
+
+    log_mount (ej, mount);
+}
+
+static void handle_mount_pre (GtkWidget *, GMount *mount, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    if (mount_filtered (ej, mount)) return;
+    DEBUG_MOUNT ("MOUNT PREUNMOUNT", mount);
+    log_eject (ej, g_mount_get_drive (mount));
+}
+
+static void handle_volume_in (GtkWidget *, GVolume *vol, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    if (volume_filtered (ej, vol)) return;
+    DEBUG_VOLUME ("VOLUME ADDED", vol);
+
+    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
+    update_icon (ej);
+}
+
+static void handle_volume_out (GtkWidget *, GVolume *vol, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    if (volume_filtered (ej, vol)) return;
+    DEBUG_VOLUME ("VOLUME REMOVED", vol);
+
+    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
+    update_icon (ej);
+}
+
+static void handle_drive_in (GtkWidget *, GDrive *drive, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    if (drive_filtered (ej, drive)) return;
+    DEBUG_DRIVE ("DRIVE ADDED", drive);
+
+    track_poll_drive (ej, drive);
+    update_polling (ej);
+
+    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
+    update_icon (ej);
+}
+
+static void handle_drive_out (GtkWidget *, GDrive *drive, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    gboolean filtered = drive_filtered (ej, drive), mounted, ejected;
+
+    /* Let go of the drive whatever the filter says now, as it may have been changed since the drive was seen */
+    g_hash_table_remove (ej->fcache, drive);
+    untrack_poll_drive (ej, drive);
+    unlimit_dirty (ej, drive);
+    mounted = was_mounted (ej, drive);
+    ejected = was_ejected (ej, drive);
+    if (filtered) return;
+    DEBUG_DRIVE ("DRIVE REMOVED", drive);
+
+    if (mounted && !ejected)
+    {
+        lxpanel_notify (ej->panel, _("Drive was removed without ejecting\nPlease use menu to eject before removal"));
+        if (ej->cleanstale && ejecter_can_clean_stale ()) clean_stale (ej, drive);
+    }
+
+    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
+    update_icon (ej);
+}
+
+static void handle_drive_changed (GtkWidget *, GDrive *drive, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    PollList *pl = find_poll_drive (ej, drive);
+
+    if (!pl) return;
+    if (g_drive_has_media (drive))
+    {
+        if (pl->empty_since) DEBUG ("MEDIA INSERTED %s", pl->dev);
+        pl->empty_since = 0;
+    }
+    else if (!pl->empty_since)
+    {
+        DEBUG ("MEDIA REMOVED %s", pl->dev);
+        pl->empty_since = g_get_monotonic_time ();
+    }
+    update_polling (ej);
+}
+
+static void handle_eject_clicked (GtkWidget *, gpointer data)
+{
+    CallbackData *dt = (CallbackData *) data;
+    EjecterPlugin *ej = dt->ej;
+    GDrive *drv = dt->drv;
+    DEBUG_DRIVE ("EJECT", drv);
+
+    gint64 *start = g_new (gint64, 1);
+    *start = g_get_monotonic_time ();
+    g_object_set_data_full (G_OBJECT (drv), "ej-eject-start", start, g_free);
+
+    g_drive_eject_with_operation (drv, G_MOUNT_UNMOUNT_NONE, NULL, NULL, eject_done, ej);
+}
+
+static void handle_safe_clicked (GtkWidget *, gpointer data)
+{
+    CallbackData *dt = (CallbackData *) data;
+    make_safe (dt->ej, dt->drv);
+}
+
+static void eject_done (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+    GDrive *drv = (GDrive *) source_object;
+    char *buffer, *dev;
+    GError *err = NULL;
+    gint64 *start;
+    guint ms;
+
+    g_drive_eject_with_operation_finish (drv, res, &err);
+
+    if (err == NULL)
+    {
+        if ((start = g_object_get_data (G_OBJECT (drv), "ej-eject-start")))
+        {
+            /* Keep separate figures for drives with a dirty data limit, to show its effect */
+            ms = (g_get_monotonic_time () - *start) / 1000;
+            dev = drive_dev_name (drv);
+            DirtyLimit *dl = dev ? find_dirty_limit (ej, dev) : NULL;
+            int i = dl && dl->method ? 1 : 0;
+            journal_log_eject_time (ej, drv, i, ms);
+            DEBUG ("EJECT TOOK %u ms%s", ms, i ? " (limited)" : "");
+            g_free (dev);
+            g_object_set_data (G_OBJECT (drv), "ej-eject-start", NULL);
+        }
+        DEBUG ("EJECT COMPLETE");
+        buffer = g_strdup_printf (_("%s has been ejected\nIt is now safe to remove the device"), g_drive_get_name (drv));
+        add_seq_for_drive (ej, drv, lxpanel_notify (ej->panel, buffer));
+    }
+    else
+    {
+        DEBUG ("EJECT FAILED");
+        buffer = g_strdup_printf (_("Failed to eject %s\n%s"), g_drive_get_name (drv), err->message);
+        lxpanel_notify (ej->panel, buffer);
+    }
+    g_free (buffer);
+}
+
+
+/* Media polling functions */
+
+static int sysfs_read_int (const char *path, int def)
+{
+    char *buf;
+    int val = def;
+
+    if (g_file_get_contents (path, &buf, NULL, NULL))
+    {
+        val = atoi (buf);
+        g_free (buf);
+    }
+    return val;
+}
+
+static gboolean sysfs_write (const char *path, const char *val)
+{
+    FILE *fp = fopen (path, "w");
+    gboolean res;
+
+    if (!fp) return FALSE;
+    res = fputs (val, fp) >= 0;
+    if (fclose (fp)) res = FALSE;
+    return res;
+}
+
+static char *drive_dev_name (GDrive *drive)
+{
+    char *name, *dev = g_drive_get_identifier (drive, "unix-device");
+
+    name = dev ? g_path_get_basename (dev) : NULL;
+    g_free (dev);
+    return name;
+}
+
+static PollList *find_poll_drive (EjecterPlugin *ej, GDrive *drive)
+{
+    GList *l;
+    for (l = ej->pdrives; l != NULL; l = l->next)
+    {
+        PollList *pl = (PollList *) l->data;
+        if (pl->drv == drive) return pl;
+    }
+    return NULL;
+}
+
+static void track_poll_drive (EjecterPlugin *ej, GDrive *drive)
+{
+    PollList *pl;
+    char *dev;
+
+    /* Only interested in readers which the system polls on its own */
+    if (!g_drive_can_poll_for_media (drive) || !g_drive_is_media_check_automatic (drive)) return;
+    if (find_poll_drive (ej, drive)) return;
+    if (!(dev = drive_dev_name (drive))) return;
+
+    pl = g_new0 (PollList, 1);
+    pl->drv = g_object_ref (drive);
+    pl->dev = dev;
+    pl->empty_since = g_drive_has_media (drive) ? 0 : g_get_monotonic_time ();
+    ej->pdrives = g_list_append (ej->pdrives, pl);
+    DEBUG ("POLLED DRIVE %s", pl->dev);
+}
+
+static void untrack_poll_drive (EjecterPlugin *ej, GDrive *drive)
+{
+    PollList *pl = find_poll_drive (ej, drive);
+
+    if (!pl) return;
+    resume_polling (ej, pl);
+    ej->pdrives = g_list_remove (ej->pdrives, pl);
+    g_object_unref (pl->drv);
+    g_free (pl->dev);
+    g_free (pl->orig_ms);
+    g_free (pl);
+}
+
+static void suspend_polling (PollList *pl)
+{
+    char *path, *orig;
+    int ms;
+
+    path = g_strdup_printf ("/sys/block/%s/events_poll_msecs", pl->dev);
+    if (g_file_get_contents (path, &orig, NULL, NULL))
+    {
+        /* -1 means the reader uses the system-wide default interval */
+        ms = atoi (orig);
+        if (ms < 0) ms = sysfs_read_int (POLL_DEFAULT_MS, 0);
+
+        if (ms > 0 && sysfs_write (path, "0"))
+        {
+            pl->poll_ms = ms;
+            pl->orig_ms = g_strstrip (orig);
+            pl->suspended = g_get_monotonic_time ();
+            DEBUG ("POLLING SUSPENDED %s (was %d ms)", pl->dev, ms);
+            g_free (path);
+            return;
+        }
+        g_free (orig);
+    }
+
+    DEBUG ("POLLING NOT SUSPENDED %s", pl->dev);
+    pl->blocked = TRUE;
+    g_free (path);
+}
+
+static void resume_polling (EjecterPlugin *ej, PollList *pl)
+{
+    char *path;
+
+    if (!pl->suspended) return;
+
+    ej->poll_saved += (g_get_monotonic_time () - pl->suspended) / 1000 / pl->poll_ms;
+    path = g_strdup_printf ("/sys/block/%s/events_poll_msecs", pl->dev);
+    sysfs_write (path, pl->orig_ms);
+    DEBUG ("POLLING RESUMED %s", pl->dev);
+    g_free (path);
+    g_free (pl->orig_ms);
+    pl->orig_ms = NULL;
+    pl->suspended = 0;
+}
+
+/* Suspend polling on readers that have been empty for long enough, and set a timer for the next one due */
+static void update_polling (EjecterPlugin *ej)
+{
+    GList *l;
+    gint64 due, next = 0, now = g_get_monotonic_time ();
+
+    for (l = ej->pdrives; l != NULL; l = l->next)
+    {
+        PollList *pl = (PollList *) l->data;
+
+        if (!ej->idlepoll || !pl->empty_since)
+        {
+            resume_polling (ej, pl);
+            pl->blocked = FALSE;
+            continue;
+        }
+        if (pl->suspended || pl->blocked) continue;
+
+        due = pl->empty_since + (gint64) ej->pollidle * G_USEC_PER_SEC;
+        if (due <= now) suspend_polling (pl);
+        else if (!next || due < next) next = due;
+    }
+
+    /* Only touch the timer if the deadline has moved, so that events don't churn sources */
+    if (next == ej->poll_due) return;
+    if (ej->poll_timer) g_source_remove (ej->poll_timer);
+    ej->poll_timer = 0;
+    ej->poll_due = next;
+    if (next)
+    {
+        ej->poll_timer = g_timeout_add_seconds ((next - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC, poll_idle_timeout, ej);
+        ej->timer_arms++;
+        DEBUG ("TIMER ARMED %d s", (int) ((next - now) / G_USEC_PER_SEC));
+    }
+}
+
+static gboolean poll_idle_timeout (gpointer data)
+{
+    EjecterPlugin *ej = (EjecterPlugin *) data;
+
+    ej->poll_timer = 0;
+    ej->poll_due = 0;
+    ej->timer_runs++;
+    update_polling (ej);
+    return FALSE;
+}
+
+/* Ask empty readers to check for media - needed for those with polling suspended */
+static void poll_media (EjecterPlugin *ej)
+{
+    GList *l;
+    for (l = ej->pdrives; l != NULL; l = l->next)
+    {
+        PollList *pl = (PollList *) l->data;
+        if (g_drive_has_media (pl->drv)) continue;
+
+        DEBUG ("POLL %s", pl->dev);
+        g_drive_poll_for_media (pl->drv, NULL, poll_done, NULL);
+        ej->polls++;
+    }
+}
+
+static void poll_done (GObject *source_object, GAsyncResult *res, gpointer)
+{
+    GError *err = NULL;
+
+    if (!g_drive_poll_for_media_finish (G_DRIVE (source_object), res, &err))
+    {
+        DEBUG ("POLL FAILED %s", err->message);
+        g_error_free (err);
+    }
+}
+
+static void stop_polling (EjecterPlugin *ej)
+{
+    if (ej->poll_timer) g_source_remove (ej->poll_timer);
+    ej->poll_timer = 0;
+    ej->poll_due = 0;
+    while (ej->pdrives) untrack_poll_drive (ej, ((PollList *) ej->pdrives->data)->drv);
+}
+
+static void show_stats (EjecterPlugin *ej)
+{
+    GList *l;
+    guint64 saved = ej->poll_saved;
+    gint64 now = g_get_monotonic_time ();
+
+    for (l = ej->pdrives; l != NULL; l = l->next)
+    {
+        PollList *pl = (PollList *) l->data;
+        if (pl->suspended) saved += (now - pl->suspended) / 1000 / pl->poll_ms;
+        g_message ("ej: %s - %s", pl->dev, pl->suspended ? "polling suspended" : (pl->empty_since ? "empty" : "media present"));
+    }
+    g_message ("ej: %u media polls requested, %" G_GUINT64_FORMAT " polling wakeups saved", ej->polls, saved);
+
+    for (l = ej->ldrives; l != NULL; l = l->next)
+    {
+        DirtyLimit *dl = (DirtyLimit *) l->data;
+        if (dl->method) g_message ("ej: %s - dirty data limited to %" G_GUINT64_FORMAT " kB by %s", dl->dev, dl->bytes / 1024, dl->method);
+        else g_message ("ej: %s - dirty data limit could not be applied", dl->dev);
+    }
+    Journal *jnl = ej->journal;
+    for (int i = 0; i < 2; i++)
+    {
+        if (jnl->ejects[i]) g_message ("ej: %u ejects %s dirty limit, average %u ms, maximum %u ms", jnl->ejects[i],
+            i ? "with" : "without", (guint) (jnl->eject_ms[i] / jnl->ejects[i]), jnl->eject_max_ms[i]);
+    }
+    for (int i = 0; i < JOURNAL_SLOTS; i++)
+    {
+        JournalRecord *jr = &jnl->rec[i];
+        if (!jr->dev[0]) continue;
+        g_message ("ej: %s %s -%s%s%s, %u ejects, average %u ms, maximum %u ms", jr->dev, jr->name,
+            jr->flags & JOURNAL_MOUNTED ? " mounted" : "", jr->flags & JOURNAL_EJECTED ? " ejected" : "",
+            jr->flags & JOURNAL_LIMITED ? " limited" : "",
+            jr->ejects, jr->ejects ? (guint) (jr->eject_ms / jr->ejects) : 0, jr->eject_max_ms);
+    }
+
+    /* With no device events, the timers line should not change between calls */
+    g_message ("ej: %u timers armed, %u run, %s pending", ej->timer_arms, ej->timer_runs, ej->poll_timer ? "one" : "none");
+}
+
+
+/* Dirty data limit functions */
+
+static DirtyLimit *find_dirty_limit (EjecterPlugin *ej, const char *dev)
+{
+    GList *l;
+    for (l = ej->ldrives; l != NULL; l = l->next)
+    {
+        DirtyLimit *dl = (DirtyLimit *) l->data;
+        if (!g_strcmp0 (dl->dev, dev)) return dl;
+    }
+    return NULL;
+}
+
+/* The global dirty threshold, which max_ratio is a percentage of */
+static guint64 dirty_threshold (void)
+{
+    guint64 avail = 0;
+    char *buf, *line;
+    int ratio;
+
+    if (g_file_get_contents ("/proc/sys/vm/dirty_bytes", &buf, NULL, NULL))
+    {
+        avail = g_ascii_strtoull (buf, NULL, 10);
+        g_free (buf);
+        if (avail) return avail;
+    }
+
+    if (g_file_get_contents ("/proc/meminfo", &buf, NULL, NULL))
+    {
+        if ((line = strstr (buf, "MemAvailable:"))) avail = g_ascii_strtoull (line + 13, NULL, 10) * 1024;
+        g_free (buf);
+    }
+    ratio = sysfs_read_int ("/proc/sys/vm/dirty_ratio", 20);
+    return avail * ratio / 100;
+}
+
+/* The sysfs directory of a drive's BDI, which is named after its device numbers */
+static char *bdi_dir (const char *dev)
+{
+    struct stat st;
+    char *path = g_strconcat ("/dev/", dev, NULL), *bdi = NULL;
+
+    if (stat (path, &st) == 0) bdi = g_strdup_printf ("/sys/class/bdi/%u:%u/", major (st.st_rdev), minor (st.st_rdev));
+    g_free (path);
+    return bdi;
+}
+
+/* Cap the dirty data the kernel will hold for a drive, so that flushing it on eject takes a bounded time */
+static void limit_dirty (EjecterPlugin *ej, GDrive *drive)
+{
+    DirtyLimit *dl;
+    char *dev;
+
+    if (!(dev = drive_dev_name (drive))) return;
+    if (find_dirty_limit (ej, dev))
+    {
+        g_free (dev);
+        return;
+    }
+
+    dl = g_new0 (DirtyLimit, 1);
+    dl->drv = g_object_ref (drive);
+    dl->dev = dev;
+    dl->bdi = bdi_dir (dev);
+    ej->ldrives = g_list_append (ej->ldrives, dl);
+
+    apply_dirty_limit (ej, dl);
+}
+
+static void apply_dirty_limit (EjecterPlugin *ej, DirtyLimit *dl)
+{
+    JournalRecord *jr;
+    char *path, *val;
+    guint64 thresh;
+
+    dl->bytes = (guint64) ej->ejecttime * DIRTY_WRITE_BPS;
+    if (!dl->bdi) return;
+
+    /* Remember the settings being overwritten - unless a crash left a limit in place, in which case
+     * the files hold that and the journal has what was there before; max_bytes is only another view
+     * of max_ratio */
+    if ((jr = journal_find (ej, dl->drv, FALSE)) && (jr->flags & JOURNAL_LIMITED))
+    {
+        if (jr->orig_ratio >= 0) dl->orig_ratio = g_strdup_printf ("%d", jr->orig_ratio);
+        if (jr->orig_strict >= 0) dl->orig_strict = g_strdup_printf ("%d", jr->orig_strict);
+    }
+    else
+    {
+        path = g_strconcat (dl->bdi, "max_ratio", NULL);
+        if (g_file_get_contents (path, &val, NULL, NULL)) dl->orig_ratio = g_strstrip (val);
+        g_free (path);
+        path = g_strconcat (dl->bdi, "strict_limit", NULL);
+        if (g_file_get_contents (path, &val, NULL, NULL)) dl->orig_strict = g_strstrip (val);
+        g_free (path);
+    }
+
+    /* max_bytes is only in recent kernels - otherwise work out the equivalent ratio */
+    path = g_strconcat (dl->bdi, "max_bytes", NULL);
+    val = g_strdup_printf ("%" G_GUINT64_FORMAT, dl->bytes);
+    if (sysfs_write (path, val)) dl->method = "max_bytes";
+    else if ((thresh = dirty_threshold ()) > 0)
+    {
+        g_free (path);
+        g_free (val);
+        path = g_strconcat (dl->bdi, "max_ratio", NULL);
+        val = g_strdup_printf ("%d", (int) CLAMP (dl->bytes * 100 / thresh, 1, 100));
+        if (sysfs_write (path, val)) dl->method = "max_ratio";
+    }
+    g_free (path);
+    g_free (val);
+
+    /* Without strict_limit, the cap only applies once the global background threshold is passed */
+    if (dl->method)
+    {
+        path = g_strconcat (dl->bdi, "strict_limit", NULL);
+        sysfs_write (path, "1");
+        g_free (path);
+        journal_set_limit (ej, dl->drv, dl);
+        DEBUG ("DIRTY LIMIT %s %" G_GUINT64_FORMAT " kB by %s", dl->dev, dl->bytes / 1024, dl->method);
+    }
+    else
+    {
+        DEBUG ("DIRTY LIMIT %s NOT APPLIED", dl->dev);
+        restore_dirty_limit (ej, dl);
+    }
+}
+
+/* Put back the settings from before the limit was applied */
+static void restore_dirty_limit (EjecterPlugin *ej, DirtyLimit *dl)
+{
+    char *path;
+
+    if (dl->method && dl->orig_ratio)
+    {
+        path = g_strconcat (dl->bdi, "max_ratio", NULL);
+        sysfs_write (path, dl->orig_ratio);
+        g_free (path);
+    }
+    if (dl->method && dl->orig_strict)
+    {
+        path = g_strconcat (dl->bdi, "strict_limit", NULL);
+        sysfs_write (path, dl->orig_strict);
+        g_free (path);
+    }
+    if (dl->method)
+    {
+        journal_set_limit (ej, dl->drv, NULL);
+        DEBUG ("DIRTY LIMIT %s REMOVED", dl->dev);
+    }
+
+    g_free (dl->orig_ratio);
+    g_free (dl->orig_strict);
+    dl->orig_ratio = NULL;
+    dl->orig_strict = NULL;
+    dl->method = NULL;
+}
 
-static void log_eject (EjecterPlugin *ej, GDrive *drive)
+static void free_dirty_limit (EjecterPlugin *ej, DirtyLimit *dl)
 {
-    EjectList *el;
-    el = g_new (EjectList, 1);
-    el->drv = drive;
-    el->seq = -1;
-    ej->ejdrives = g_list_append (ej->ejdrives, el);
+    ej->ldrives = g_list_remove (ej->ldrives, dl);
+    g_object_unref (dl->drv);
+    g_free (dl->orig_ratio);
+    g_free (dl->orig_strict);
+    g_free (dl->bdi);
+    g_free (dl->dev);
+    g_free (dl);
 }
 
-static gboolean was_ejected (EjecterPlugin *ej, GDrive *drive)
+/* Bring the limits on drives already present into line with a changed eject time */
+static void update_dirty_limits (EjecterPlugin *ej)
 {
-    GList *l;
-    gboolean ejected = FALSE;
-    for (l = ej->ejdrives; l != NULL; l = l->next)
+    GList *l, *next;
+
+    if (ej->ejecttime == ej->dirty_time) return;
+    ej->dirty_time = ej->ejecttime;
+
+    for (l = ej->ldrives; l != NULL; l = next)
     {
-        EjectList *el = (EjectList *) l->data;
-        if (el->drv == drive)
+        DirtyLimit *dl = (DirtyLimit *) l->data;
+        next = l->next;
+
+        restore_dirty_limit (ej, dl);
+        if (ej->ejecttime > 0) apply_dirty_limit (ej, dl);
+        else free_dirty_limit (ej, dl);
+    }
+
+    if (ej->ejecttime <= 0) return;
+    for (l = ej->mdrives; l != NULL; l = l->next)
+        if (g_drive_is_removable ((GDrive *) l->data)) limit_dirty (ej, (GDrive *) l->data);
+}
+
+/* The BDI goes away with the drive, so there is nothing to put back */
+static void unlimit_dirty (EjecterPlugin *ej, GDrive *drive)
+{
+    DirtyLimit *dl;
+    char *dev;
+
+    journal_set_limit (ej, drive, NULL);
+    if (!(dev = drive_dev_name (drive))) return;
+    if ((dl = find_dirty_limit (ej, dev))) free_dirty_limit (ej, dl);
+    g_free (dev);
+}
+
+/* A limit left behind by a crash which has not been taken over must not stay in place */
+static void restore_stale_limit (EjecterPlugin *ej, GDrive *drive, JournalRecord *jr)
+{
+    char *dev, *bdi, *path, *val;
+
+    if (!(dev = drive_dev_name (drive))) return;
+    if (!find_dirty_limit (ej, dev))
+    {
+        if ((bdi = bdi_dir (dev)))
         {
-            ejected = TRUE;
-            if (el->seq != -1) lxpanel_notify_clear (el->seq);
-            ej->ejdrives = g_list_remove (ej->ejdrives, el);
-            g_free (el);
+            if (jr->orig_ratio >= 0)
+            {
+                path = g_strconcat (bdi, "max_ratio", NULL);
+                val = g_strdup_printf ("%d", jr->orig_ratio);
+                sysfs_write (path, val);
+                g_free (val);
+                g_free (path);
+            }
+            if (jr->orig_strict >= 0)
+            {
+                path = g_strconcat (bdi, "strict_limit", NULL);
+                val = g_strdup_printf ("%d", jr->orig_strict);
+                sysfs_write (path, val);
+                g_free (val);
+                g_free (path);
+            }
+            g_free (bdi);
         }
+        DEBUG ("DIRTY LIMIT %s REMOVED AFTER CRASH", dev);
+        journal_set_limit (ej, drive, NULL);
     }
-    return ejected;
+    g_free (dev);
 }
 
-static void log_mount (EjecterPlugin *ej, GMount *mount)
+
+/* Make safe functions - flush and remount read-only, leaving the drive available */
+
+static void make_safe (EjecterPlugin *ej, GDrive *drv)
 {
-    GList *l;
-    GDrive *drv, *drive = g_mount_get_drive (mount);
-    for (l = ej->mdrives; l != NULL; l = l->next)
+    SafeData *sd;
+    SafeVolume *sv;
+    GList *iter, *vols;
+    GTask *task;
+
+    DEBUG_DRIVE ("MAKE SAFE", drv);
+
+    sd = g_new0 (SafeData, 1);
+    sd->ej = ej;
+    sd->drv = g_object_ref (drv);
+
+    /* Collect everything needed from GIO here, as the work is done in a thread */
+    vols = g_drive_get_volumes (drv);
+    for (iter = vols; iter != NULL; iter = g_list_next (iter))
     {
-        drv = (GDrive *) l->data;
-        if (drv == drive)
+        GVolume *v = (GVolume *) iter->data;
+        GMount *m = g_volume_get_mount (v);
+        if (!m) continue;
+
+        GFile *root = g_mount_get_root (m);
+        char *path = g_file_get_path (root);
+        char *dev = g_volume_get_identifier (v, G_VOLUME_IDENTIFIER_KIND_UNIX_DEVICE);
+        if (path && dev)
         {
-            g_object_unref (drive);
-            return;
+            sv = g_new0 (SafeVolume, 1);
+            sv->path = path;
+            sv->dev = dev;
+            sd->vols = g_list_append (sd->vols, sv);
+        }
+        else
+        {
+            g_free (path);
+            g_free (dev);
         }
+        g_object_unref (root);
+        g_object_unref (m);
     }
+    g_list_free_full (vols, g_object_unref);
 
-    ej->mdrives = g_list_append (ej->mdrives, drive);
-    DEBUG ("MOUNTED DRIVE %s", g_drive_get_name (drive));
+    task = g_task_new (NULL, ej->cancel, make_safe_done, NULL);
+    g_task_set_task_data (task, sd, (GDestroyNotify) free_safe_data);
+    g_task_run_in_thread (task, make_safe_thread);
+    g_object_unref (task);
 }
 
-static void log_init_mounts (EjecterPlugin *ej)
+/* Object paths are escaped forms of the kernel name, which a device path may not even give, so ask udisks */
+static char *udisks_object (GDBusConnection *bus, const char *dev, GError **err)
 {
-    ej->mdrives = NULL;
-    GList *l, *mnts = g_volume_monitor_get_mounts (ej->monitor);
-    for (l = mnts; l != NULL; l = l->next)
-    {
-        log_mount (ej, (GMount *) l->data);
-        g_object_unref (l->data);
-    }
-    g_list_free (mnts);
+    GVariantBuilder spec;
+    GVariantIter *iter;
+    GVariant *res;
+    char *obj = NULL;
+
+    g_variant_builder_init (&spec, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&spec, "{sv}", "path", g_variant_new_string (dev));
+    res = g_dbus_connection_call_sync (bus, UDISKS_NAME, UDISKS_MANAGER_PATH, UDISKS_MANAGER_IFACE, "ResolveDevice",
+        g_variant_new ("(a{sv}a{sv})", &spec, NULL), G_VARIANT_TYPE ("(ao)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, err);
+    if (!res) return NULL;
+
+    g_variant_get (res, "(ao)", &iter);
+    if (!g_variant_iter_next (iter, "o", &obj))
+        g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, _("%s is not known to udisks"), dev);
+    g_variant_iter_free (iter);
+    g_variant_unref (res);
+    return obj;
 }
 
-static gboolean was_mounted (EjecterPlugin *ej, GDrive *drive)
+/* Always sets err on failure, as a call which fails its preconditions returns without doing so */
+static gboolean udisks_call (GDBusConnection *bus, const char *dev, const char *method, GVariant *params, char **path, GError **err)
 {
-    GList *l;
-    GDrive *drv;
-    for (l = ej->mdrives; l != NULL; l = l->next)
+    GError *error = NULL;
+    GVariant *res = NULL;
+    char *obj;
+
+    g_variant_ref_sink (params);
+    if ((obj = udisks_object (bus, dev, &error)))
+        res = g_dbus_connection_call_sync (bus, UDISKS_NAME, obj, UDISKS_FS_IFACE, method, params,
+            NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    g_variant_unref (params);
+    g_free (obj);
+
+    if (!res)
     {
-        drv = (GDrive *) l->data;
-        if (drv == drive)
-        {
-            ej->mdrives = g_list_remove (ej->mdrives, drv);
-            g_object_unref (drv);
-            return TRUE;
-        }
+        if (!error) error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED, _("Could not call udisks for %s"), dev);
+        g_propagate_error (err, error);
+        return FALSE;
     }
-    return FALSE;
+
+    if (path) g_variant_get (res, "(s)", path);
+    g_variant_unref (res);
+    return TRUE;
 }
 
-static void add_seq_for_drive (EjecterPlugin *ej, GDrive *drive, int seq)
+static void make_safe_thread (GTask *task, gpointer, gpointer data, GCancellable *)
 {
-    GList *l;
-    for (l = ej->ejdrives; l != NULL; l = l->next)
+    SafeData *sd = (SafeData *) data;
+    GDBusConnection *bus;
+    GVariantBuilder opts;
+    struct statvfs st;
+    GError *err = NULL;
+    GList *iter;
+    char *path;
+    int fd;
+
+    if (g_task_return_error_if_cancelled (task)) return;
+
+    if (!(bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &err)))
     {
-        EjectList *el = (EjectList *) l->data;
-        if (el->drv == drive)
+        sd->error = g_strdup (err->message);
+        g_error_free (err);
+        g_task_return_boolean (task, FALSE);
+        return;
+    }
+
+    for (iter = sd->vols; iter != NULL && !sd->error; iter = g_list_next (iter))
+    {
+        SafeVolume *sv = (SafeVolume *) iter->data;
+
+        /* Flush first, so that the unmount has nothing left to write back */
+        fd = open (sv->path, O_RDONLY | O_DIRECTORY);
+        if (fd >= 0)
         {
-            el->seq = seq;
-            return;
+            syncfs (fd);
+            close (fd);
+        }
+
+        /* udisks cannot remount, so unmount and mount again read-only */
+        g_variant_builder_init (&opts, G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add (&opts, "{sv}", "options", g_variant_new_string ("ro"));
+        path = NULL;
+        if (!udisks_call (bus, sv->dev, "Unmount", g_variant_new ("(a{sv})", NULL), NULL, &err)
+            || !udisks_call (bus, sv->dev, "Mount", g_variant_new ("(a{sv})", &opts), &path, &err))
+        {
+            g_variant_builder_clear (&opts);
+            sd->error = g_strdup (err ? err->message : _("udisks call failed"));
+            g_clear_error (&err);
+            break;
         }
+
+        /* A read-only mount cannot hold dirty data - check that is what we got */
+        if (statvfs (path, &st) || !(st.f_flag & ST_RDONLY))
+            sd->error = g_strdup_printf (_("%s was not mounted read-only"), path);
+        g_free (path);
     }
+
+    g_object_unref (bus);
+    g_task_return_boolean (task, sd->error == NULL);
 }
 
-static void handle_mount_in (GtkWidget *, GMount *mount, gpointer data)
+static void make_safe_done (GObject *, GAsyncResult *res, gpointer)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    DEBUG ("MOUNT ADDED %s", g_mount_get_name (mount));
+    SafeData *sd = (SafeData *) g_task_get_task_data (G_TASK (res));
+    EjecterPlugin *ej = sd->ej;
+    GError *err = NULL;
+    char *buffer, *name;
 
-    log_mount (ej, mount);
-    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    /* Cancelled means the plugin has gone, so there is no-one left to tell */
+    if (!g_task_propagate_boolean (G_TASK (res), &err) && g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free (err);
+        return;
+    }
+    if (err) g_error_free (err);
+
+    name = g_drive_get_name (sd->drv);
+    if (sd->error == NULL)
+    {
+        /* Unmounting through udisks does not raise mount-pre-unmount, so log the eject here */
+        DEBUG ("MAKE SAFE COMPLETE");
+        if (!is_ejected (ej, sd->drv)) log_eject (ej, sd->drv);
+        buffer = g_strdup_printf (_("%s is now read-only\nIt is safe to remove the device"), name);
+        add_seq_for_drive (ej, sd->drv, lxpanel_notify (ej->panel, buffer));
+    }
+    else
+    {
+        DEBUG ("MAKE SAFE FAILED %s", sd->error);
+        buffer = g_strdup_printf (_("Failed to make %s safe\n%s"), name, sd->error);
+        lxpanel_notify (ej->panel, buffer);
+    }
+    g_free (buffer);
+    g_free (name);
 }
 
-static void handle_mount_out (GtkWidget *, GMount *mount, gpointer data)
+static void free_safe_data (SafeData *sd)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    DEBUG ("MOUNT REMOVED %s", g_mount_get_name (mount));
-
-    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    GList *iter;
+    for (iter = sd->vols; iter != NULL; iter = g_list_next (iter))
+    {
+        SafeVolume *sv = (SafeVolume *) iter->data;
+        g_free (sv->path);
+        g_free (sv->dev);
+        g_free (sv);
+    }
+    g_list_free (sd->vols);
+    g_object_unref (sd->drv);
+    g_free (sd->error);
+    g_free (sd);
 }
 
-static void handle_mount_pre (GtkWidget *, GMount *mount, gpointer data)
+
+/* Stale mount functions - detach whatever is left mounted from a drive pulled out without ejecting */
+
+static void clean_stale (EjecterPlugin *ej, GDrive *drive)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    DEBUG ("MOUNT PREUNMOUNT %s", g_mount_get_name (mount));
-    log_eject (ej, g_mount_get_drive (mount));
+    StaleData *sd;
+    GTask *task;
+    char *dev;
+
+    if (!(dev = drive_dev_name (drive))) return;
+    DEBUG ("CLEAN STALE %s", dev);
+
+    sd = g_new0 (StaleData, 1);
+    sd->ej = ej;
+    sd->dev = dev;
+    sd->name = g_drive_get_name (drive);
+    sd->procs = g_string_new (NULL);
+
+    task = g_task_new (NULL, ej->cancel, clean_stale_done, NULL);
+    g_task_set_task_data (task, sd, (GDestroyNotify) free_stale_data);
+    g_task_run_in_thread (task, clean_stale_thread);
+    g_object_unref (task);
 }
 
-static void handle_volume_in (GtkWidget *, GVolume *vol, gpointer data)
+/* Is path the device or one of its partitions, e.g. /dev/sdb1 or /dev/mmcblk0p1 for sdb or mmcblk0? */
+static gboolean is_part_of (const char *path, const char *dev)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    DEBUG ("VOLUME ADDED %s", g_volume_get_name (vol));
+    size_t len = strlen (dev);
 
-    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    if (!len || !g_str_has_prefix (path, "/dev/") || strncmp (path + 5, dev, len)) return FALSE;
+    path += 5 + len;
+    if (*path == 0) return TRUE;
+
+    /* Names ending in a digit put a "p" before the partition number, so that mmcblk1 does not match mmcblk10 */
+    if (g_ascii_isdigit (dev[len - 1]) && *path++ != 'p') return FALSE;
+    if (!g_ascii_isdigit (*path)) return FALSE;
+    while (g_ascii_isdigit (*path)) path++;
+    return *path == 0;
 }
 
-static void handle_volume_out (GtkWidget *, GVolume *vol, gpointer data)
+static gboolean is_under (const char *path, GList *mnts)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    DEBUG ("VOLUME REMOVED %s", g_volume_get_name (vol));
+    GList *l;
+    size_t len;
 
-    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    for (l = mnts; l != NULL; l = l->next)
+    {
+        len = strlen ((char *) l->data);
+        if (!strncmp (path, (char *) l->data, len) && (path[len] == 0 || path[len] == '/')) return TRUE;
+    }
+    return FALSE;
 }
 
-static void handle_drive_in (GtkWidget *, GDrive *drive, gpointer data)
+/* Look for processes with files or working directories on the mounts - only our own are visible */
+static void find_stale_users (GList *mnts, GString *procs)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    DEBUG ("DRIVE ADDED %s", g_drive_get_name (drive));
+    GDir *proc, *fds;
+    const char *pid, *fd;
+    char *path, *link, *comm;
+    gboolean found;
 
-    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
+    if (!(proc = g_dir_open ("/proc", 0, NULL))) return;
+    while ((pid = g_dir_read_name (proc)))
+    {
+        if (!g_ascii_isdigit (*pid)) continue;
+
+        path = g_strdup_printf ("/proc/%s/cwd", pid);
+        link = g_file_read_link (path, NULL);
+        found = link && is_under (link, mnts);
+        g_free (link);
+        g_free (path);
+
+        path = g_strdup_printf ("/proc/%s/fd", pid);
+        fds = found ? NULL : g_dir_open (path, 0, NULL);
+        g_free (path);
+        while (fds && !found && (fd = g_dir_read_name (fds)))
+        {
+            path = g_strdup_printf ("/proc/%s/fd/%s", pid, fd);
+            link = g_file_read_link (path, NULL);
+            found = link && is_under (link, mnts);
+            g_free (link);
+            g_free (path);
+        }
+        if (fds) g_dir_close (fds);
+
+        if (found)
+        {
+            path = g_strdup_printf ("/proc/%s/comm", pid);
+            if (g_file_get_contents (path, &comm, NULL, NULL))
+            {
+                g_string_append_printf (procs, "%s%s (%s)", procs->len ? ", " : "", g_strstrip (comm), pid);
+                g_free (comm);
+            }
+            g_free (path);
+        }
+    }
+    g_dir_close (proc);
 }
 
-static void handle_drive_out (GtkWidget *, GDrive *drive, gpointer data)
+static void clean_stale_thread (GTask *task, gpointer, gpointer data, GCancellable *)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    DEBUG ("DRIVE REMOVED %s", g_drive_get_name (drive));
+    StaleData *sd = (StaleData *) data;
+    GDBusConnection *bus = NULL;
+    GUnixMountEntry *me;
+    GVariantBuilder opts;
+    GList *l, *d, *ents, *mnts = NULL, *devs = NULL;
+    GError *err = NULL;
 
-    if (was_mounted (ej, drive) && !was_ejected (ej, drive))
-        lxpanel_notify (ej->panel, _("Drive was removed without ejecting\nPlease use menu to eject before removal"));
+    if (g_task_return_error_if_cancelled (task)) return;
 
-    if (ej->menu && gtk_widget_get_visible (ej->menu)) show_menu (ej);
-    update_icon (ej);
-}
+    ents = g_unix_mounts_get (NULL);
+    for (l = ents; l != NULL; l = l->next)
+    {
+        GUnixMountEntry *me = (GUnixMountEntry *) l->data;
+        if (is_part_of (g_unix_mount_get_device_path (me), sd->dev))
+        {
+            mnts = g_list_prepend (mnts, g_strdup (g_unix_mount_get_mount_path (me)));
+            devs = g_list_prepend (devs, g_strdup (g_unix_mount_get_device_path (me)));
+        }
+    }
+    g_list_free_full (ents, (GDestroyNotify) g_unix_mount_free);
 
-static void handle_eject_clicked (GtkWidget *, gpointer data)
-{
-    CallbackData *dt = (CallbackData *) data;
-    EjecterPlugin *ej = dt->ej;
-    GDrive *drv = dt->drv;
-    DEBUG ("EJECT %s", g_drive_get_name (drv));
+    /* Must be done before detaching, as afterwards the paths no longer lead anywhere */
+    if (mnts) find_stale_users (mnts, sd->procs);
 
-    g_drive_eject_with_operation (drv, G_MOUNT_UNMOUNT_NONE, NULL, NULL, eject_done, ej);
+    /* Lazily detach each mount; if not allowed to, ask udisks to force the unmount, which does the same */
+    for (l = mnts, d = devs; l != NULL; l = l->next, d = d->next)
+    {
+        if (umount2 ((char *) l->data, MNT_DETACH) == 0)
+        {
+            sd->mounts++;
+            continue;
+        }
+
+        if (!bus) bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+        g_variant_builder_init (&opts, G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add (&opts, "{sv}", "force", g_variant_new_boolean (TRUE));
+        if (bus && udisks_call (bus, (char *) d->data, "Unmount", g_variant_new ("(a{sv})", &opts), NULL, &err)) sd->mounts++;
+        else
+        {
+            if (!bus) g_variant_builder_clear (&opts);
+            g_clear_error (&err);
+
+            /* udisks unmounts what it mounted itself when a drive goes, and drops the drive's objects, so
+             * it may have got there first - that is only a failure if the mount is still there */
+            if ((me = g_unix_mount_at ((char *) l->data, NULL)))
+            {
+                g_unix_mount_free (me);
+                sd->failed++;
+            }
+            else sd->mounts++;
+        }
+    }
+
+    if (bus) g_object_unref (bus);
+    g_list_free_full (devs, g_free);
+    g_list_free_full (mnts, g_free);
+    g_task_return_boolean (task, TRUE);
 }
 
-static void eject_done (GObject *source_object, GAsyncResult *res, gpointer data)
+static void clean_stale_done (GObject *, GAsyncResult *res, gpointer)
 {
-    EjecterPlugin *ej = (EjecterPlugin *) data;
-    GDrive *drv = (GDrive *) source_object;
-    char *buffer;
+    StaleData *sd = (StaleData *) g_task_get_task_data (G_TASK (res));
+    EjecterPlugin *ej = sd->ej;
     GError *err = NULL;
+    char *buffer;
 
-    g_drive_eject_with_operation_finish (drv, res, &err);
+    /* Cancelled means the plugin has gone, so there is no-one left to tell */
+    if (!g_task_propagate_boolean (G_TASK (res), &err) && g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free (err);
+        return;
+    }
+    if (err) g_error_free (err);
 
-    if (err == NULL)
+    DEBUG ("CLEAN STALE %s - %d detached, %d failed, used by %s", sd->dev, sd->mounts, sd->failed, sd->procs->len ? sd->procs->str : "none");
+
+    if (sd->mounts && sd->procs->len)
     {
-        DEBUG ("EJECT COMPLETE");
-        buffer = g_strdup_printf (_("%s has been ejected\nIt is now safe to remove the device"), g_drive_get_name (drv));
-        add_seq_for_drive (ej, drv, lxpanel_notify (ej->panel, buffer));
+        buffer = g_strdup_printf (_("Cleaned up after removal of %s\nPrograms affected: %s"), sd->name, sd->procs->str);
+        lxpanel_notify (ej->panel, buffer);
+        g_free (buffer);
     }
-    else
+    else if (sd->failed)
     {
-        DEBUG ("EJECT FAILED");
-        buffer = g_strdup_printf (_("Failed to eject %s\n%s"), g_drive_get_name (drv), err->message);
+        buffer = g_strdup_printf (_("Could not clean up after removal of %s"), sd->name);
         lxpanel_notify (ej->panel, buffer);
+        g_free (buffer);
     }
-    g_free (buffer);
+}
+
+static void free_stale_data (StaleData *sd)
+{
+    g_string_free (sd->procs, TRUE);
+    g_free (sd->dev);
+    g_free (sd->name);
+    g_free (sd);
 }
 
 
 /* Ejecter functions */
 
-static gboolean is_drive_mounted (GDrive *d)
+static gboolean is_drive_mounted (EjecterPlugin *ej, GDrive *d)
+{
+    GList *viter, *vols;
+    gboolean mounted = FALSE;
+
+    if (drive_filtered (ej, d)) return FALSE;
+
+    vols = g_drive_get_volumes (d);
+    for (viter = vols; viter != NULL && !mounted; viter = g_list_next (viter))
+    {
+        GMount *m = g_volume_get_mount ((GVolume *) viter->data);
+        if (m == NULL) continue;
+        if (!mount_filtered (ej, m)) mounted = TRUE;
+        g_object_unref (m);
+    }
+    g_list_free_full (vols, g_object_unref);
+    return mounted;
+}
+
+/* Uses the mount table rather than asking the filesystem, which can hang if the drive has gone */
+static gboolean is_mount_writable (GMount *m)
+{
+    GFile *root = g_mount_get_root (m);
+    char *path = g_file_get_path (root);
+    GUnixMountEntry *me = path ? g_unix_mount_at (path, NULL) : NULL;
+    gboolean writable = me && !g_unix_mount_is_readonly (me);
+
+    if (me) g_unix_mount_free (me);
+    g_free (path);
+    g_object_unref (root);
+    return writable;
+}
+
+static gboolean is_drive_writable (GDrive *d)
 {
     GList *viter, *vols = g_drive_get_volumes (d);
+    gboolean writable = FALSE;
 
-    for (viter = vols; viter != NULL; viter = g_list_next (viter))
+    for (viter = vols; viter != NULL && !writable; viter = g_list_next (viter))
     {
-        if (g_volume_get_mount ((GVolume *) viter->data) != NULL) return TRUE;
+        GMount *m = g_volume_get_mount ((GVolume *) viter->data);
+        if (!m) continue;
+
+        writable = is_mount_writable (m);
+        g_object_unref (m);
     }
-    return FALSE;
+    g_list_free_full (vols, g_object_unref);
+    return writable;
 }
 
 static void update_icon (EjecterPlugin *ej)
@@ -304,7 +1921,7 @@ static void update_icon (EjecterPlugin *ej)
         for (driter = drives; driter != NULL; driter = g_list_next (driter))
         {
             GDrive *drv = (GDrive *) driter->data;
-            if (is_drive_mounted (drv))
+            if (is_drive_mounted (ej, drv))
             {
                 gtk_widget_show_all (ej->plugin);
                 gtk_widget_set_sensitive (ej->plugin, TRUE);
@@ -335,7 +1952,7 @@ static void show_menu (EjecterPlugin *ej)
     for (driter = drives; driter != NULL; driter = g_list_next (driter))
     {
         GDrive *drv = (GDrive *) driter->data;
-        if (is_drive_mounted (drv))
+        if (is_drive_mounted (ej, drv))
         {
             GtkWidget *item = create_menuitem (ej, drv);
             CallbackData *dt = g_new0 (CallbackData, 1);
@@ -344,6 +1961,14 @@ static void show_menu (EjecterPlugin *ej)
             g_signal_connect (item, "activate", G_CALLBACK (handle_eject_clicked), dt);
             gtk_menu_shell_append (GTK_MENU_SHELL (ej->menu), item);
             count++;
+
+            /* Offer to make the drive safe without ejecting if anything on it is writable */
+            if (is_drive_writable (drv))
+            {
+                item = wrap_new_menu_item (ej, _("Make safe - keep mounted read-only"), 40, NULL);
+                g_signal_connect (item, "activate", G_CALLBACK (handle_safe_clicked), dt);
+                gtk_menu_shell_append (GTK_MENU_SHELL (ej->menu), item);
+            }
         }
     }
 
@@ -409,6 +2034,7 @@ static GtkWidget *create_menuitem (EjecterPlugin *ej, GDrive *d)
 static void ejecter_button_clicked (GtkWidget *, EjecterPlugin * ej)
 {
     CHECK_LONGPRESS
+    poll_media (ej);
     show_menu (ej);
 }
 
@@ -416,13 +2042,40 @@ static void ejecter_button_clicked (GtkWidget *, EjecterPlugin * ej)
 void ejecter_update_display (EjecterPlugin * ej)
 {
     wrap_set_taskbar_icon (ej, ej->tray_icon, "media-eject");
+    if (g_strcmp0 (ej->filter, ej->fcompiled)) compile_filter (ej);
     update_icon (ej);
+    update_polling (ej);
+    update_dirty_limits (ej);
 }
 
 /* Handler for control message */
 gboolean ejecter_control_msg (EjecterPlugin *ej, const char *cmd)
 {
-    DEBUG ("Eject command device %s\n", cmd);
+    DEBUG ("Control command %s", cmd);
+
+#ifdef DEBUG_ON
+    if (!g_strcmp0 (cmd, "trace"))
+    {
+        trace_dump (STDERR_FILENO);
+        return TRUE;
+    }
+#endif
+
+    if (!g_strcmp0 (cmd, "poll"))
+    {
+        poll_media (ej);
+        return TRUE;
+    }
+
+    if (!g_strcmp0 (cmd, "stats"))
+    {
+        show_stats (ej);
+        return TRUE;
+    }
+
+    /* "safe <device>" makes a drive safe, otherwise the command is a device being ejected externally */
+    gboolean safe = g_str_has_prefix (cmd, "safe ");
+    if (safe) cmd += 5;
 
     /* Loop through all drives until we find the one matching the supplied device */
     GList *iter, *drives = g_volume_monitor_get_connected_drives (ej->monitor);
@@ -433,8 +2086,12 @@ gboolean ejecter_control_msg (EjecterPlugin *ej, const char *cmd)
 
         if (!g_strcmp0 (id, cmd)) 
         {
-            DEBUG ("EXTERNAL EJECT %s", g_drive_get_name (d));
-            log_eject (ej, d);
+            if (safe) make_safe (ej, d);
+            else
+            {
+                DEBUG_DRIVE ("EXTERNAL EJECT", d);
+                log_eject (ej, d);
+            }
         }
         g_free (id);
     }
@@ -442,8 +2099,26 @@ gboolean ejecter_control_msg (EjecterPlugin *ej, const char *cmd)
     return TRUE;
 }
 
+/* Detaching mounts needs CAP_SYS_ADMIN - udisks cannot do it once the drive has gone, as it drops the drive's objects */
+gboolean ejecter_can_clean_stale (void)
+{
+    guint64 caps = 0;
+    char *buf, *line;
+
+    if (g_file_get_contents ("/proc/self/status", &buf, NULL, NULL))
+    {
+        if ((line = strstr (buf, "\nCapEff:"))) caps = g_ascii_strtoull (line + 8, NULL, 16);
+        g_free (buf);
+    }
+    return (caps >> CAP_SYS_ADMIN) & 1;
+}
+
 void ejecter_init (EjecterPlugin *ej)
 {
+#ifdef DEBUG_ON
+    trace_start ();
+#endif
+
     setlocale (LC_ALL, "");
     bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
     bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
@@ -463,7 +2138,12 @@ void ejecter_init (EjecterPlugin *ej)
     /* Set up variables */
     ej->popup = NULL;
     ej->menu = NULL;
-    ej->hide_timer = 0;
+    ej->pdrives = NULL;
+    ej->poll_timer = 0;
+    ej->dirty_time = ej->ejecttime;
+    ej->fcache = g_hash_table_new_full (NULL, NULL, g_object_unref, NULL);
+    ej->cancel = g_cancellable_new ();
+    compile_filter (ej);
 
     /* Get volume monitor and connect to events */
     ej->monitor = g_volume_monitor_get ();
@@ -471,11 +2151,22 @@ void ejecter_init (EjecterPlugin *ej)
     g_signal_connect (ej->monitor, "volume-removed", G_CALLBACK (handle_volume_out), ej);
     g_signal_connect (ej->monitor, "mount-added", G_CALLBACK (handle_mount_in), ej);
     g_signal_connect (ej->monitor, "mount-removed", G_CALLBACK (handle_mount_out), ej);
+    g_signal_connect (ej->monitor, "mount-changed", G_CALLBACK (handle_mount_changed), ej);
     g_signal_connect (ej->monitor, "mount-pre-unmount", G_CALLBACK (handle_mount_pre), ej);
     g_signal_connect (ej->monitor, "drive-connected", G_CALLBACK (handle_drive_in), ej);
     g_signal_connect (ej->monitor, "drive-disconnected", G_CALLBACK (handle_drive_out), ej);
+    g_signal_connect (ej->monitor, "drive-changed", G_CALLBACK (handle_drive_changed), ej);
 
+    journal_open (ej);
     log_init_mounts (ej);
+    journal_restore (ej);
+
+    /* Find card readers and the like whose media polling can be managed */
+    GList *iter, *drives = g_volume_monitor_get_connected_drives (ej->monitor);
+    for (iter = drives; iter != NULL; iter = g_list_next (iter))
+        if (!drive_filtered (ej, (GDrive *) iter->data)) track_poll_drive (ej, (GDrive *) iter->data);
+    g_list_free_full (drives, g_object_unref);
+    update_polling (ej);
 
     /* Show the widget and return. */
     gtk_widget_show_all (ej->plugin);
@@ -485,6 +2176,26 @@ void ejecter_destructor (gpointer user_data)
 {
     EjecterPlugin *ej = (EjecterPlugin *) user_data;
 
+    /* Nothing may call back into the plugin once it has gone */
+    g_cancellable_cancel (ej->cancel);
+    g_object_unref (ej->cancel);
+    g_signal_handlers_disconnect_by_data (ej->monitor, ej);
+    g_object_unref (ej->monitor);
+    stop_polling (ej);
+    free_filter (ej);
+    g_hash_table_destroy (ej->fcache);
+    while (ej->ldrives)
+    {
+        DirtyLimit *dl = (DirtyLimit *) ej->ldrives->data;
+        restore_dirty_limit (ej, dl);
+        free_dirty_limit (ej, dl);
+    }
+    g_free (ej->filter);
+    journal_close (ej);
+
+#ifdef DEBUG_ON
+    trace_stop ();
+#endif
     g_free (ej);
 }
 
@@ -498,6 +2209,7 @@ static GtkWidget *ejecter_constructor (LXPanel *panel, config_setting_t *setting
 {
     /* Allocate and initialize plugin context */
     EjecterPlugin *ej = g_new0 (EjecterPlugin, 1);
+    const char *str;
 
     /* Allocate top level widget and set into plugin widget pointer. */
     ej->panel = panel;
@@ -507,6 +2219,12 @@ static GtkWidget *ejecter_constructor (LXPanel *panel, config_setting_t *setting
 
     /* Read config */
     if (!config_setting_lookup_int (ej->settings, "AutoHide", &ej->autohide)) ej->autohide = TRUE;
+    if (!config_setting_lookup_int (ej->settings, "IdlePoll", &ej->idlepoll)) ej->idlepoll = FALSE;
+    if (!config_setting_lookup_int (ej->settings, "PollIdleTime", &ej->pollidle)) ej->pollidle = 300;
+    if (!config_setting_lookup_int (ej->settings, "EjectTime", &ej->ejecttime)) ej->ejecttime = 0;
+    if (!config_setting_lookup_int (ej->settings, "CleanStale", &ej->cleanstale)) ej->cleanstale = FALSE;
+    if (config_setting_lookup_string (ej->settings, "Filter", &str)) ej->filter = g_strdup (str);
+    else ej->filter = g_strdup (DEFAULT_FILTER);
 
     ejecter_init (ej);
 
@@ -545,6 +2263,11 @@ static gboolean ejecter_apply_configuration (gpointer user_data)
     EjecterPlugin *ej = lxpanel_plugin_get_data (GTK_WIDGET (user_data));
 
     config_group_set_int (ej->settings, "AutoHide", ej->autohide);
+    config_group_set_int (ej->settings, "IdlePoll", ej->idlepoll);
+    config_group_set_int (ej->settings, "PollIdleTime", ej->pollidle);
+    config_group_set_int (ej->settings, "EjectTime", ej->ejecttime);
+    config_group_set_int (ej->settings, "CleanStale", ej->cleanstale);
+    config_group_set_string (ej->settings, "Filter", ej->filter);
 
     ejecter_update_display (ej);
     return FALSE;
@@ -555,9 +2278,15 @@ static GtkWidget *ejecter_configure (LXPanel *panel, GtkWidget *plugin)
 {
     EjecterPlugin *ej = lxpanel_plugin_get_data (plugin);
 
+    /* Cleaning up is only offered if the panel is allowed to do it - otherwise its NULL label ends the list */
     return lxpanel_generic_config_dlg(_("Ejecter"), panel,
         ejecter_apply_configuration, plugin,
         _("Hide icon when no devices"), &ej->autohide, CONF_TYPE_BOOL,
+        _("Stop polling empty card readers"), &ej->idlepoll, CONF_TYPE_BOOL,
+        _("Seconds empty before polling stops"), &ej->pollidle, CONF_TYPE_INT,
+        _("Limit eject time to (seconds, 0 for no limit)"), &ej->ejecttime, CONF_TYPE_INT,
+        _("Ignore devices matching"), &ej->filter, CONF_TYPE_STR,
+        ejecter_can_clean_stale () ? _("Clean up after drives removed without ejecting") : NULL, &ej->cleanstale, CONF_TYPE_BOOL,
         NULL);
 }
 
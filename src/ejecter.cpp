@@ -33,11 +33,21 @@ extern "C" {
     WayfireWidget *create () { return new WayfireEjecter; }
     void destroy (WayfireWidget *w) { delete w; }
 
-    static constexpr conf_table_t conf_table[2] = {
+    static conf_table_t conf_table[7] = {
         {CONF_BOOL, "autohide", N_("Hide icon when no devices")},
+        {CONF_BOOL, "idlepoll", N_("Stop polling empty card readers")},
+        {CONF_INT,  "pollidle", N_("Seconds empty before polling stops")},
+        {CONF_INT,  "ejecttime", N_("Limit eject time to (seconds, 0 for no limit)")},
+        {CONF_STRING, "filter", N_("Ignore devices matching")},
+        {CONF_BOOL, "cleanstale", N_("Clean up after drives removed without ejecting")},
         {CONF_NONE,  NULL,       NULL}
     };
-    const conf_table_t *config_params (void) { return conf_table; };
+    const conf_table_t *config_params (void)
+    {
+        /* Cleaning up is only offered if the panel is allowed to do it */
+        if (!ejecter_can_clean_stale ()) conf_table[5] = conf_table[6];
+        return conf_table;
+    };
     const char *display_name (void) { return N_("Ejecter"); };
     const char *package_name (void) { return GETTEXT_PACKAGE; };
 }
@@ -68,6 +78,12 @@ bool WayfireEjecter::set_icon (void)
 void WayfireEjecter::settings_changed_cb (void)
 {
     ej->autohide = autohide;
+    ej->idlepoll = idlepoll;
+    ej->pollidle = pollidle;
+    ej->ejecttime = ejecttime;
+    ej->cleanstale = cleanstale;
+    g_free (ej->filter);
+    ej->filter = g_strdup (((std::string) filter).c_str ());
     ejecter_update_display (ej);
 }
 
@@ -88,6 +104,10 @@ void WayfireEjecter::init (Gtk::HBox *container)
     /* Add long press for right click */
     gesture = add_longpress_default (*plugin);
 
+    /* Filter and dirty limit must be known before the initial scan of devices */
+    ej->ejecttime = ejecttime;
+    ej->filter = g_strdup (((std::string) filter).c_str ());
+
     /* Initialise the plugin */
     ejecter_init (ej);
 
@@ -96,6 +116,11 @@ void WayfireEjecter::init (Gtk::HBox *container)
     bar_pos.set_callback (sigc::mem_fun (*this, &WayfireEjecter::bar_pos_changed_cb));
 
     autohide.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    idlepoll.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    pollidle.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    ejecttime.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    cleanstale.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
+    filter.set_callback (sigc::mem_fun (*this, &WayfireEjecter::settings_changed_cb));
 
     settings_changed_cb ();
 }
@@ -29,6 +29,41 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* Typedefs and macros                                                        */
 /*----------------------------------------------------------------------------*/
 
+/* Drive state journal - this is the file format, so only add to the end and bump the version */
+#define JOURNAL_MAGIC 0x4a4a4745
+#define JOURNAL_VERSION 2
+#define JOURNAL_SLOTS 32
+
+#define JOURNAL_MOUNTED 0x01
+#define JOURNAL_EJECTED 0x02
+#define JOURNAL_LIMITED 0x04
+
+typedef struct
+{
+    gint seq;                       /* Odd while the record is being written */
+    guint32 flags;                  /* JOURNAL_MOUNTED, JOURNAL_EJECTED, JOURNAL_LIMITED */
+    char dev[32];                   /* Block device name, empty if slot is free */
+    char name[64];                  /* Drive name, to tell apart drives given the same device */
+    guint32 ejects;                 /* Eject timings for this drive */
+    guint32 eject_max_ms;
+    guint64 eject_ms;
+    gint64 updated;                 /* Wall clock time of last change */
+    gint32 orig_ratio;              /* Settings a dirty data limit replaced, -1 if not known */
+    gint32 orig_strict;
+} JournalRecord;
+
+typedef struct
+{
+    guint32 magic;
+    guint32 version;
+    gint seq;                       /* Odd while the totals are being written */
+    guint32 ejects[2];              /* Eject timings, for drives without and with dirty data limits */
+    guint32 eject_max_ms[2];
+    guint32 pad;
+    guint64 eject_ms[2];
+    JournalRecord rec[JOURNAL_SLOTS];
+} Journal;
+
 typedef struct 
 {
     GtkWidget *plugin;
@@ -51,7 +86,29 @@ typedef struct
     gboolean autohide;
     GList *ejdrives;
     GList *mdrives;
-    guint hide_timer;
+    gboolean idlepoll;              /* Suspend media polling on idle readers */
+    int pollidle;                   /* Seconds a reader is empty before polling is suspended */
+    GList *pdrives;                 /* Drives with managed media polling */
+    guint poll_timer;
+    gint64 poll_due;                /* Time poll_timer is due to fire */
+    guint timer_arms;               /* Main loop timers started */
+    guint timer_runs;               /* Main loop timers dispatched */
+    guint polls;                    /* On-demand media polls requested */
+    guint64 poll_saved;             /* Polling wakeups avoided */
+    char *filter;                   /* Rules for devices to ignore */
+    char *fcompiled;                /* Rules the filter was last compiled from */
+    GPtrArray *fdev;                /* Compiled filter patterns, by what they match */
+    GPtrArray *ffs;
+    GPtrArray *fbus;
+    GPtrArray *fmnt;
+    GHashTable *fcache;             /* Filter result for each drive and mount seen */
+    int ejecttime;                  /* Worst-case eject time in seconds used to limit dirty data, 0 for none */
+    GList *ldrives;                 /* Drives with dirty data limits */
+    int dirty_time;                 /* Eject time the current limits were worked out for */
+    gboolean cleanstale;            /* Detach mounts left behind by drives removed without ejecting */
+    GCancellable *cancel;           /* Cancels background work when the plugin goes */
+    Journal *journal;               /* Drive state and eject history, kept across restarts */
+    gboolean jmapped;               /* Journal is mapped from a file rather than allocated */
 } EjecterPlugin;
 
 /*----------------------------------------------------------------------------*/
@@ -61,6 +118,7 @@ typedef struct
 extern void ejecter_init (EjecterPlugin *ej);
 extern void ejecter_update_display (EjecterPlugin *ej);
 extern gboolean ejecter_control_msg (EjecterPlugin *ej, const char *cmd);
+extern gboolean ejecter_can_clean_stale (void);
 extern void ejecter_destructor (gpointer user_data);
 
 /* End of file */
@@ -47,6 +47,11 @@ class WayfireEjecter : public WayfireWidget
     sigc::connection icon_timer;
 
     WfOption <bool> autohide {"panel/ejecter_autohide"};
+    WfOption <bool> idlepoll {"panel/ejecter_idlepoll"};
+    WfOption <int> pollidle {"panel/ejecter_pollidle"};
+    WfOption <int> ejecttime {"panel/ejecter_ejecttime"};
+    WfOption <bool> cleanstale {"panel/ejecter_cleanstale"};
+    WfOption <std::string> filter {"panel/ejecter_filter"};
 
     /* plugin */
     EjecterPlugin *ej;
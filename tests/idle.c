@@ -0,0 +1,247 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi Holdings Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Idle wakeup test - with an empty card reader and no device events, the plugin must arm its idle timer at most
+ * once, and after that must not dispatch or schedule any main loop sources */
+
+#include <gtk/gtk.h>
+
+/* Build the plugin core against a volume monitor which only ever has one empty card reader */
+static GVolumeMonitor *stub_monitor_get (void);
+#define g_volume_monitor_get stub_monitor_get
+#include "ejecter.c"
+#undef g_volume_monitor_get
+
+#define IDLE_SECS 5
+#define POLL_IDLE_SECS 1
+
+/* Not a real device, so that suspending its polling is refused rather than done */
+#define STUB_DEVICE "/dev/ejstub0"
+
+static GDrive *stub_drive;
+
+/*----------------------------------------------------------------------------*/
+/* Stub drive - a reader the system polls for media, with none inserted       */
+/*----------------------------------------------------------------------------*/
+
+typedef GObject StubDrive;
+typedef GObjectClass StubDriveClass;
+
+static void stub_drive_iface_init (GDriveIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (StubDrive, stub_drive, G_TYPE_OBJECT, G_IMPLEMENT_INTERFACE (G_TYPE_DRIVE, stub_drive_iface_init))
+
+static char *stub_drive_get_name (GDrive *)
+{
+    return g_strdup ("Stub reader");
+}
+
+static GIcon *stub_drive_get_icon (GDrive *)
+{
+    return g_themed_icon_new ("drive-removable-media");
+}
+
+static GList *stub_drive_get_volumes (GDrive *)
+{
+    return NULL;
+}
+
+static gboolean stub_drive_yes (GDrive *)
+{
+    return TRUE;
+}
+
+static gboolean stub_drive_no (GDrive *)
+{
+    return FALSE;
+}
+
+static char *stub_drive_get_identifier (GDrive *, const char *kind)
+{
+    return g_strcmp0 (kind, G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE) ? NULL : g_strdup (STUB_DEVICE);
+}
+
+static char **stub_drive_enumerate_identifiers (GDrive *)
+{
+    char *ids[] = { G_DRIVE_IDENTIFIER_KIND_UNIX_DEVICE, NULL };
+    return g_strdupv (ids);
+}
+
+static void stub_drive_iface_init (GDriveIface *iface)
+{
+    iface->get_name = stub_drive_get_name;
+    iface->get_icon = stub_drive_get_icon;
+    iface->has_volumes = stub_drive_no;
+    iface->get_volumes = stub_drive_get_volumes;
+    iface->is_removable = stub_drive_yes;
+    iface->is_media_removable = stub_drive_yes;
+    iface->has_media = stub_drive_no;
+    iface->is_media_check_automatic = stub_drive_yes;
+    iface->can_poll_for_media = stub_drive_yes;
+    iface->can_eject = stub_drive_no;
+    iface->get_identifier = stub_drive_get_identifier;
+    iface->enumerate_identifiers = stub_drive_enumerate_identifiers;
+}
+
+static void stub_drive_class_init (StubDriveClass *)
+{
+}
+
+static void stub_drive_init (StubDrive *)
+{
+}
+
+/*----------------------------------------------------------------------------*/
+/* Stub volume monitor                                                        */
+/*----------------------------------------------------------------------------*/
+
+typedef GVolumeMonitor StubMonitor;
+typedef GVolumeMonitorClass StubMonitorClass;
+
+G_DEFINE_TYPE (StubMonitor, stub_monitor, G_TYPE_VOLUME_MONITOR)
+
+static GList *stub_get_list (GVolumeMonitor *)
+{
+    return NULL;
+}
+
+static GList *stub_get_drives (GVolumeMonitor *)
+{
+    return g_list_prepend (NULL, g_object_ref (stub_drive));
+}
+
+static GVolume *stub_get_volume (GVolumeMonitor *, const char *)
+{
+    return NULL;
+}
+
+static GMount *stub_get_mount (GVolumeMonitor *, const char *)
+{
+    return NULL;
+}
+
+static void stub_monitor_class_init (StubMonitorClass *klass)
+{
+    klass->get_connected_drives = stub_get_drives;
+    klass->get_volumes = stub_get_list;
+    klass->get_mounts = stub_get_list;
+    klass->get_volume_for_uuid = stub_get_volume;
+    klass->get_mount_for_uuid = stub_get_mount;
+}
+
+static void stub_monitor_init (StubMonitor *)
+{
+}
+
+static GVolumeMonitor *stub_monitor_get (void)
+{
+    return g_object_new (stub_monitor_get_type (), NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Test                                                                       */
+/*----------------------------------------------------------------------------*/
+
+/* Is any source ready, or waiting on a timeout? */
+static gboolean source_pending (GMainContext *ctx)
+{
+    GPollFD fds[64];
+    gint prio, timeout, nfds;
+
+    if (!g_main_context_acquire (ctx)) return TRUE;
+    g_main_context_prepare (ctx, &prio);
+    nfds = g_main_context_query (ctx, G_MAXINT, &timeout, fds, G_N_ELEMENTS (fds));
+    g_main_context_check (ctx, G_MAXINT, fds, MIN (nfds, (gint) G_N_ELEMENTS (fds)));
+    g_main_context_release (ctx);
+    return timeout >= 0;
+}
+
+int main (int argc, char *argv[])
+{
+    GMainContext *ctx = g_main_context_default ();
+    EjecterPlugin *ej;
+    gint64 end;
+    guint arms;
+    int i, dispatched = 0, pending = 0;
+
+    /* Skip rather than fail when there is no display to create widgets on */
+    if (!gtk_init_check (&argc, &argv)) return 77;
+
+    stub_drive = g_object_new (stub_drive_get_type (), NULL);
+
+    ej = g_new0 (EjecterPlugin, 1);
+    ej->plugin = gtk_button_new ();
+    ej->autohide = TRUE;
+    ej->idlepoll = TRUE;
+    ej->pollidle = POLL_IDLE_SECS;
+    ej->ejecttime = 10;
+    ej->cleanstale = TRUE;
+    ej->filter = g_strdup (DEFAULT_FILTER);
+    ejecter_init (ej);
+    ejecter_update_display (ej);
+
+    /* Let anything queued while starting up run to completion */
+    for (i = 0; i < 1000 && g_main_context_iteration (ctx, FALSE); i++);
+
+    /* The empty reader arms the one-shot idle timer; give it time to fire */
+    end = g_get_monotonic_time () + (POLL_IDLE_SECS + 2) * G_USEC_PER_SEC;
+    while (g_get_monotonic_time () < end)
+    {
+        g_main_context_iteration (ctx, FALSE);
+        g_usleep (G_USEC_PER_SEC / 50);
+    }
+
+    arms = ej->timer_arms;
+    if (arms != 1 || ej->timer_runs != 1)
+    {
+        g_printerr ("empty reader should arm and run the idle timer once: %u armed, %u run\n", arms, ej->timer_runs);
+        ejecter_destructor (ej);
+        return 1;
+    }
+
+    end = g_get_monotonic_time () + IDLE_SECS * G_USEC_PER_SEC;
+    while (g_get_monotonic_time () < end)
+    {
+        if (source_pending (ctx)) pending++;
+        if (g_main_context_iteration (ctx, FALSE)) dispatched++;
+        g_usleep (G_USEC_PER_SEC / 50);
+    }
+
+    arms = ej->timer_arms - arms;
+    ejecter_destructor (ej);
+    g_object_unref (stub_drive);
+
+    if (dispatched || pending || arms)
+    {
+        g_printerr ("idle plugin woke up: %d dispatches, %d checks with sources pending, %u timers armed\n", dispatched, pending, arms);
+        return 1;
+    }
+    return 0;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
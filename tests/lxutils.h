@@ -0,0 +1,51 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi Holdings Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Stand-in for the panel utility header, so that the plugin core can be built and run without a panel */
+
+#ifndef TEST_LXUTILS_H
+#define TEST_LXUTILS_H
+
+#include <gtk/gtk.h>
+
+#define CHECK_LONGPRESS
+
+#define lxpanel_notify(panel,msg) (g_message ("notify: %s", msg), 0)
+#define lxpanel_notify_clear(seq)
+
+#define wrap_set_taskbar_icon(plugin,image,icon)
+#define wrap_set_menu_icon(plugin,image,icon)
+#define wrap_new_menu_item(plugin,text,maxlen,icon) gtk_menu_item_new_with_label (text)
+#define wrap_show_menu(plugin,menu)
+
+#define lxpanel_plugin_update_menu_icon(item,icon) g_object_ref_sink (icon)
+#define lxpanel_plugin_append_menu_icon(item,icon) g_object_ref_sink (icon)
+
+#endif
+
+/* End of file */
+/*----------------------------------------------------------------------------*/
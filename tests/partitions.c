@@ -0,0 +1,79 @@
+/*============================================================================
+Copyright (c) 2025 Raspberry Pi Holdings Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Partition match test - stale mount cleanup must only pick up the removed device and its own partitions */
+
+#include <gtk/gtk.h>
+
+#include "ejecter.c"
+
+static const struct
+{
+    const char *path;
+    const char *dev;
+    gboolean match;
+} cases[] =
+{
+    { "/dev/sdb", "sdb", TRUE },
+    { "/dev/sdb1", "sdb", TRUE },
+    { "/dev/sdb12", "sdb", TRUE },
+    { "/dev/sdc1", "sdb", FALSE },
+    { "/dev/sdba1", "sdb", FALSE },
+    { "/dev/sdbp1", "sdb", FALSE },
+    { "/dev/mmcblk1", "mmcblk1", TRUE },
+    { "/dev/mmcblk1p1", "mmcblk1", TRUE },
+    { "/dev/mmcblk1p", "mmcblk1", FALSE },
+    { "/dev/mmcblk10", "mmcblk1", FALSE },
+    { "/dev/mmcblk10p1", "mmcblk1", FALSE },
+    { "/dev/loop1", "loop1", TRUE },
+    { "/dev/loop1p2", "loop1", TRUE },
+    { "/dev/loop10", "loop1", FALSE },
+    { "/dev/nvme0n1", "nvme0n1", TRUE },
+    { "/dev/nvme0n1p2", "nvme0n1", TRUE },
+    { "/dev/nvme0n12", "nvme0n1", FALSE },
+    { "/dev/nvme0n1p2", "nvme0n", FALSE },
+    { "sdb1", "sdb", FALSE },
+    { "/dev/mapper/sdb1", "sdb", FALSE },
+    { "/dev/sdb1", "", FALSE },
+};
+
+int main (void)
+{
+    guint i;
+    int failed = 0;
+
+    for (i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+        if (is_part_of (cases[i].path, cases[i].dev) == cases[i].match) continue;
+        g_printerr ("%s %s be taken as part of %s\n", cases[i].path, cases[i].match ? "should" : "should not", cases[i].dev);
+        failed++;
+    }
+    return failed ? 1 : 0;
+}
+
+/* End of file */
+/*----------------------------------------------------------------------------*/